@@ -7,6 +7,9 @@ class AppDelegate
   AppOACentralConfigurationDidGetNotificationUserInfo = "AppOACentralConfigurationDidGetNotificationUserInfo"
 
   def application(application, didFinishLaunchingWithOptions:launchOptions)
+    # カメラキットのログを受け取り始めます。
+    AppCameraLog.instance
+
     rootViewController = SettingsViewController.alloc.init
     rootViewController.title = 'OlyMotion'
     rootViewController.view.backgroundColor = UIColor.whiteColor
@@ -26,7 +26,15 @@ class PhotoViewController < UIViewController
     }
   }
 
-  attr_accessor :previousRunMode, :liveImageView, :restorationIdentifier
+  # 撮影した画像をカメラロールに保存するのを待つ時間の上限(秒)です。
+  SAVE_TIMEOUT = 10.0
+  # 撮影画面を抜ける時に、拡大ビューの終了を待つ時間の上限(秒)です。
+  MAGNIFY_STOP_TIMEOUT = 2.0
+
+  # ピンチでこの比率だけ広げるか縮めるたびに、拡大ビューの倍率を1段階変えます。
+  MAGNIFYING_PINCH_STEP = 1.4
+
+  attr_accessor :previousRunMode, :liveImageView, :liveViewPipeline, :liveViewAnalyzer, :magnifyController, :restorationIdentifier
 
   def viewDidLoad
     super
@@ -37,6 +45,9 @@ class PhotoViewController < UIViewController
 
     setting = AppSetting.instance
     setting.addObserver(self, forKeyPath:"showLiveImageGrid", options:0, context:'didChangeShowLiveImageGrid:')
+    setting.addObserver(self, forKeyPath:"showLiveImageHistogram", options:0, context:'didChangeShowLiveImageHistogram:')
+    setting.addObserver(self, forKeyPath:"showFocusPeaking", options:0, context:'didChangeShowFocusPeaking:')
+    setting.addObserver(self, forKeyPath:"showZebra", options:0, context:'didChangeShowZebra:')
 
     liveViewHeight = Device.screen.height
     liveViewWidth  = liveViewHeight * 1.5
@@ -45,6 +56,35 @@ class PhotoViewController < UIViewController
     self.view << @liveImageView
     @panelView = PanelView.new
     self.view << @panelView
+    # ライブビューのデコードはメインスレッドとカメラキットのスレッド以外で行います。
+    weakSelf = WeakRef.new(self)
+    @liveViewPipeline = LiveViewPipeline.new do |image, metadata, analysis|
+      weakSelf.presentLiveViewImage(image, analysis)
+    end
+    # ヒストグラム・フォーカスピーキング・ゼブラはデコードしたワーカーで続けて求めます。
+    @liveViewAnalyzer = LiveViewAnalyzer.new
+    updateLiveViewAnalysis
+    # デコードと解析に要した時間はライブビューのサイズを決める材料にします。
+    @liveViewPipeline.observer = ->(frame) {
+      AppCamera.instance.reportLiveViewDecodeTime((frame[:analyzedAt] || frame[:decodedAt]) - frame[:decodeStartedAt])
+    }
+    # 拡大ビューの移動と倍率変更はまとめてカメラに送り、追いつくまでは最後の全体のフレームを切り抜いて見せます。
+    @magnifyController = MagnifyController.new(AppCamera.instance)
+    @magnifyController.previewHandler = ->(rect, settled) {
+      weakSelf.showMagnifyingPreview(rect, settled)
+    }
+    panGestureRecognizer = UIPanGestureRecognizer.alloc.initWithTarget(self, action:'handleMagnifyingPan:')
+    panGestureRecognizer.maximumNumberOfTouches = 1
+    panGestureRecognizer.delegate = self
+    @liveImageView.addGestureRecognizer(panGestureRecognizer)
+    pinchGestureRecognizer = UIPinchGestureRecognizer.alloc.initWithTarget(self, action:'handleMagnifyingPinch:')
+    pinchGestureRecognizer.delegate = self
+    @liveImageView.addGestureRecognizer(pinchGestureRecognizer)
+    # 撮影した画像のプレビューは、次の撮影と並行して受信した順にカメラロールへ保存します。
+    @assetsLibrary = ALAssetsLibrary.alloc.init
+    AppCamera.instance.captureScheduler.imageHandler = ->(data, metadata, shot) {
+      weakSelf.saveCapturedImage(data, metadata)
+    }
     Motion::Layout.new do |layout|
       layout.view self.view
       layout.subviews liveImageView: @liveImageView, panelView: @panelView
@@ -58,6 +98,7 @@ class PhotoViewController < UIViewController
     NSNotificationCenter.defaultCenter.addObserver(self, selector:'toggleWhiteBalance', name:'ToggleWhiteBalanceButtonWasTapped', object:nil)
     NSNotificationCenter.defaultCenter.addObserver(self, selector:'toggleTakeMode', name:'ToggleTakeModeButtonWasTapped', object:nil)
     NSNotificationCenter.defaultCenter.addObserver(self, selector:'toggleAeLockState', name:'ToggleAeLockStateButtonWasTapped', object:nil)
+    NSNotificationCenter.defaultCenter.addObserver(self, selector:'releaseShutter', name:'ReleaseShutterButtonWasTapped', object:nil)
 
     # 監視するカメラプロパティ名とそれに紐づいた対応処理(メソッド名)を対とする辞書を用意して、
     # Objective-CのKVOチックに、カメラプロパティに変化があったらその個別処理を呼び出せるようにしてみます。
@@ -72,7 +113,6 @@ class PhotoViewController < UIViewController
     }
     # カメラプロパティ、カメラのプロパティを監視開始します。
     camera = AppCamera.instance
-    camera.init_properties
     camera.addCameraPropertyDelegate(self)
     camera.addObserver(self, forKeyPath:'actualApertureValue', options:0, context:nil)
     camera.addObserver(self, forKeyPath:'actualShutterSpeed', options:0, context:nil)
@@ -105,6 +145,8 @@ class PhotoViewController < UIViewController
     super(animated)
     navigationController.setNavigationBarHidden(true, animated:animated)
     navigationController.setToolbarHidden(true, animated:animated)
+    # 活動していない間に変わった表示設定を反映します。
+    updateLiveViewAnalysis
   end
 
   def viewWillDisappear(animated)
@@ -115,6 +157,7 @@ class PhotoViewController < UIViewController
     NSNotificationCenter.defaultCenter.removeObserver(self, name:'ToggleWhiteBalanceButtonWasTapped', object:nil)
     NSNotificationCenter.defaultCenter.removeObserver(self, name:'ToggleTakeModeButtonWasTapped', object:nil)
     NSNotificationCenter.defaultCenter.removeObserver(self, name:'ToggleAeLockStateButtonWasTapped', object:nil)
+    NSNotificationCenter.defaultCenter.removeObserver(self, name:'ReleaseShutterButtonWasTapped', object:nil)
   end
 
   def viewDidDisappear(animated)
@@ -156,6 +199,8 @@ class PhotoViewController < UIViewController
 
   # 画面タッチ
   def touchesBegan(touches, withEvent:event)
+    # 拡大ビューの時のタッチは表示範囲の移動に使います。
+    return if @magnifyController.magnifying
     if event.touchesForView(@liveImageView)
       camera = AppCamera.instance
       if camera.connectionType == OLYCameraConnectionTypeWiFi
@@ -270,32 +315,27 @@ class PhotoViewController < UIViewController
       end
       dp "Why the live view is already started?" if !camera.autoStartLiveView && camera.liveViewEnabled
 
-      # # 最新スナップショットからカメラ設定を復元します。
-      # setting = AppSetting.instance
-      # if setting.keepLastCameraSetting
-      #   snapshot = setting.latestSnapshotOfCameraSetting
-      #   if snapshot
-      #     NSDictionary *optimizedSnapshot = [camera optimizeSnapshotOfSetting:snapshot error:&error];
-      #     if (optimizedSnapshot) {
-      #       NSArray *exclude = @[
-      #         CameraPropertyWifiCh, # Wi-Fiチャンネルの設定は復元しません。
-      #       ];
-      #       [weakSelf reportBlockSettingToProgress:progressView];
-      #       if (![camera restoreSnapshotOfSetting:optimizedSnapshot exclude:exclude fallback:YES error:error)
-      #         weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:NSLocalizedString(@"$title:CouldNotRestoreLastestCameraSetting", @"RecordingViewController.didStartActivity")];
-      #         # エラーを無視して続行します。
-      #         dp "An error occurred, but ignores it."
-      #       }
-      #       progressView.mode = MBProgressHUDModeIndeterminate;
-      #     } else {
-      #       weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:NSLocalizedString(@"$title:CouldNotRestoreLastestCameraSetting", @"RecordingViewController.didStartActivity")];
-      #       # エラーを無視して続行します。
-      #       dp "An error occurred, but ignores it."
-      #     }
-      #   } else {
-      #     dp "No snapshots."
-      #   }
-      # }
+      # 最新スナップショットからカメラ設定を復元します。
+      # 今の値と違うものだけをまとめて書き込むので、前回と同じ設定なら書き込みは起きません。
+      setting = AppSetting.instance
+      snapshot = (setting['keepLastCameraSetting'] != false) ? setting['latestSnapshotOfCameraSetting'] : nil
+      dp "No snapshots." unless snapshot
+      camera.propertyCache.resetStatistics
+      startTime = CACurrentMediaTime()
+      AppCameraTrace.instance.measure('initProperties') {
+        # Wi-Fiチャンネルの設定は復元しません。
+        camera.init_properties(snapshot, exclude:['WIFI_CH'])
+      }
+      # オートブラケット撮影とインターバルタイマー撮影の設定を反映します。
+      camera.autoBracketingMode = setting['autoBracketingMode'] || 'AppCameraAutoBracketingModeDisabled'
+      camera.autoBracketingCount = setting['autoBracketingCount'] || 3
+      camera.autoBracketingStep = setting['autoBracketingStep'] || 3
+      camera.intervalTimerMode = setting['intervalTimerMode'] || 'AppCameraIntervalTimerModeDisabled'
+      camera.intervalTimerCount = setting['intervalTimerCount'] || 10
+      camera.intervalTimerTime = setting['intervalTimerTime'] || 5.0
+
+      stats = camera.propertyCache.statistics
+      dp "カメラ設定: #{((CACurrentMediaTime() - startTime) * 1000).round(1)}ms, roundTrips=#{stats[:roundTrips]}, roundTripsSaved=#{stats[:roundTripsSaved]}, writesSent=#{stats[:writesSent]}/#{stats[:writesRequested]}"
 
       # # 現在位置を取得します。
       # RecordingLocationManager *locationManager = [[RecordingLocationManager alloc] init];
@@ -316,6 +356,7 @@ class PhotoViewController < UIViewController
 
       # ライブビューの表示を開始にします。
       # MARK: ライブビュー自動開始が有効でないなら、明示的にライブビューの表示開始を呼び出さなければなりません。
+      weakSelf.liveViewPipeline.start
       camera.addLiveViewDelegate(weakSelf)
       camera.addRecordingDelegate(weakSelf)
       camera.addRecordingSupportsDelegate(weakSelf)
@@ -349,6 +390,9 @@ class PhotoViewController < UIViewController
     dp "すでに活動停止している場合は何もしません。"
     return unless @startingActivity
 
+    stats = @magnifyController.statistics
+    dp "拡大ビュー: requests=#{stats[:requests]}, commands=#{stats[:commands]}, settleTime(p95)=#{((stats[:settleTime95] || 0) * 1000).round}ms"
+
     dp "パネル表示を終了します。"
     # [self.embeddedSPanelViewController didFinishActivity];
     # [self.embeddedEPanelViewController didFinishActivity];
@@ -364,40 +408,45 @@ class PhotoViewController < UIViewController
       camera = AppCamera.instance
       dp "Why the live view is already stopped?" if !camera.autoStartLiveView && !camera.liveViewEnabled
 
+      dp "撮影中なら止めます。"
+      camera.stopTakingPluralPictures if camera.runningTakingPluralPictures
+
+      dp "拡大ビューを終了します。"
+      # MARK: 拡大ビューのまま抜けると、表示範囲とライブビューのサイズの下限が次の撮影画面に残ってしまいます。
+      weakSelf.magnifyController.stop
+      weakSelf.magnifyController.waitUntilSettled(MAGNIFY_STOP_TIMEOUT)
+      error = Pointer.new(:object)
+      if camera.magnifyingLiveView && !camera.stopMagnifyingLiveView(error)
+        # エラーを無視して続行します。
+        dp "An error occurred, but ignores it."
+      end
+
       dp "ライブビューの表示を終了します。"
       # MARK: ライブビュー自動開始が有効でないなら、明示的にライブビューの表示停止を呼び出さなければなりません。
       camera.removeLiveViewDelegate(weakSelf)
+      weakSelf.liveViewPipeline.stop
+      stats = weakSelf.liveViewPipeline.statistics
+      dp "ライブビュー: received=#{stats[:received]}, presented=#{stats[:presented]}, droppedBeforeDecode=#{stats[:droppedBeforeDecode]}, droppedAfterDecode=#{stats[:droppedAfterDecode]}, analyze(p95)=#{(stats[:analyze][:p95] * 1000).round(1)}ms, receiveToPresent(p95)=#{(stats[:receiveToPresent][:p95] * 1000).round(1)}ms"
+      weakSelf.liveViewAnalyzer.purge
       camera.removeRecordingDelegate(weakSelf)
       camera.removeRecordingSupportsDelegate(weakSelf)
       camera.removeTakingPictureDelegate(weakSelf)
-      error = Pointer.new(:object)
       unless camera.stopLiveView(error)
         # エラーを無視して続行します。
         dp "An error occurred, but ignores it."
       end
 
-      # # カメラ設定のスナップショットを取ります。
-      # # FIXME: 撮影中にここに突入してきた場合にここで取ったカメラ設定のスナップショットが復元可能なのか分かりません...
-      # setting = AppSetting.instance
-      # if (setting.keepLastCameraSetting) {
-      #   NSDictionary *snapshot = [camera createSnapshotOfSetting:&error];
-      #   if (snapshot) {
-      #     NSDictionary *optimizedSnapshot = [camera optimizeSnapshotOfSetting:snapshot error:&error];
-      #     if (optimizedSnapshot) {
-      #       # ユーザー設定の更新はメインスレッドで実行しないと接続画面で監視している人が困るようです。
-      #       # (接続画面側の画面更新がとても遅れる)
-      #       [weakSelf executeAsynchronousBlockOnMainThread:^{
-      #         setting.latestSnapshotOfCameraSetting = optimizedSnapshot;
-      #       }];
-      #     } else {
-      #       # エラーを無視して続行します。
-      #       dp "An error occurred, but ignores it."
-      #     }
-      #   } else {
-      #     # エラーを無視して続行します。
-      #     dp "An error occurred, but ignores it."
-      #   }
-      # }
+      # カメラ設定のスナップショットを取ります。
+      # FIXME: 撮影中にここに突入してきた場合にここで取ったカメラ設定のスナップショットが復元可能なのか分かりません...
+      setting = AppSetting.instance
+      if setting['keepLastCameraSetting'] != false
+        snapshot = camera.snapshotOfSetting
+        # ユーザー設定の更新はメインスレッドで実行しないと接続画面で監視している人が困るようです。
+        # (接続画面側の画面更新がとても遅れる)
+        Dispatch::Queue.main.async {
+          setting['latestSnapshotOfCameraSetting'] = snapshot
+        }
+      end
 
       dp "カメラを以前のモードに移行します。"
       unless camera.changeRunMode(weakSelf.previousRunMode, error:error)
@@ -414,9 +463,15 @@ class PhotoViewController < UIViewController
   end
 
   def camera(camera, didUpdateLiveView:data, metadata:metadata)
-    # dp "ライブビューの表示を最新の画像で更新します。"
-    # metadataにはカメラ本体の回転情報が入っているが、3（天地逆）以外はすべて正対として扱う
-    image = OLYCameraConvertDataToImage(data, {"Orientation" => (metadata['Orientation'] == 3 ? 3 : 1)})
+    # MARK: このデリゲートはカメラキットのスレッドから呼び出されます。
+    # ここでデコードすると次のフレームの受信が遅れるので、パイプラインに渡してすぐに戻ります。
+    @liveViewPipeline.receive(data, metadata)
+  end
+
+  # ライブビューの表示を最新の画像で更新します。(メインスレッドで呼び出されます)
+  def presentLiveViewImage(image, analysis = nil)
+    # 拡大する前の全体のフレームを、拡大ビューのプレビュー用に取っておきます。
+    @lastFullFrame = image unless @magnifyController.cameraMagnifying
     if !@liveImageView.image && image
       dp "初めての表示更新の場合はフェードインアニメーションを伴います。"
       @liveImageView.alpha = 0.0
@@ -431,12 +486,60 @@ class PhotoViewController < UIViewController
     else
       @liveImageView.image = image
     end
+    @liveImageView.showAnalysis(analysis) if analysis
+    if @hidesMagnifyingPreviewOnNextFrame
+      @hidesMagnifyingPreviewOnNextFrame = false
+      @liveImageView.hideMagnifyingPreview
+    end
     # dp "ライブビューの回転方向をライブビュー拡大表示の全体図に反映します。"
     # self.liveImageOverallView.orientation = @liveImageView.image.imageOrientation
   end
 
 
 
+  # 拡大ビューの表示範囲が変わる時に呼び出されます。(メインスレッドで呼び出されます)
+  # カメラが追いつくまではプレビューを見せて、追いついたら次のフレームから本物に切り替えます。
+  def showMagnifyingPreview(rect, settled)
+    if !rect || !@magnifyController.magnifying
+      @hidesMagnifyingPreviewOnNextFrame = false
+      @liveImageView.hideMagnifyingPreview
+    elsif settled
+      @hidesMagnifyingPreviewOnNextFrame = true
+    else
+      @hidesMagnifyingPreviewOnNextFrame = false
+      @liveImageView.showMagnifyingPreview(@lastFullFrame, rect)
+    end
+  end
+
+  # 拡大ビューの時だけパンとピンチを受け付けます。
+  def gestureRecognizerShouldBegin(recognizer)
+    @magnifyController.magnifying
+  end
+
+  def handleMagnifyingPan(recognizer)
+    translation = recognizer.translationInView(@liveImageView)
+    recognizer.setTranslation(CGPointZero, inView:@liveImageView)
+    rect = @magnifyController.targetRect
+    size = @liveImageView.bounds.size
+    # 指と同じ向きに画像が動くように、表示範囲は逆向きに動かします。天地逆の時はさらに逆にします。
+    image = @liveImageView.image
+    sign = (image && image.imageOrientation == UIImageOrientationDown) ? 1.0 : -1.0
+    @magnifyController.scrollBy(sign * translation.x / size.width * rect.size.width, sign * translation.y / size.height * rect.size.height)
+  end
+
+  def handleMagnifyingPinch(recognizer)
+    return unless recognizer.state == UIGestureRecognizerStateChanged
+    scales = MagnifyingAreaConcern::MAGNIFYING_FACTORS.keys
+    index = scales.index(@magnifyController.scale) || 0
+    if recognizer.scale >= MAGNIFYING_PINCH_STEP && index < scales.size - 1
+      @magnifyController.changeScale(scales[index + 1])
+      recognizer.scale = 1.0
+    elsif recognizer.scale <= 1.0 / MAGNIFYING_PINCH_STEP && index > 0
+      @magnifyController.changeScale(scales[index - 1])
+      recognizer.scale = 1.0
+    end
+  end
+
   # キー値監視機構によって呼び出されます。
   def observeValueForKeyPath(keyPath, ofObject:object, change:change, context:context)
     return unless @startingActivity
@@ -468,6 +571,34 @@ class PhotoViewController < UIViewController
     @panelView.updateIsoSensitivityLabel
   end
 
+  def didChangeShowLiveImageHistogram
+    updateLiveViewAnalysis
+  end
+
+  def didChangeShowFocusPeaking
+    updateLiveViewAnalysis
+  end
+
+  def didChangeShowZebra
+    updateLiveViewAnalysis
+  end
+
+  # ヒストグラム・フォーカスピーキング・ゼブラの表示設定を反映します。(メインスレッドで呼び出します)
+  # どれも既定では表示しません。どれも表示しない時は解析もしません。
+  def updateLiveViewAnalysis
+    setting = AppSetting.instance
+    analyzer = @liveViewAnalyzer
+    previous = [analyzer.histogramEnabled, analyzer.peakingEnabled, analyzer.zebraEnabled]
+    analyzer.histogramEnabled = (setting['showLiveImageHistogram'] == true)
+    analyzer.peakingEnabled = (setting['showFocusPeaking'] == true)
+    analyzer.zebraEnabled = (setting['showZebra'] == true)
+    current = [analyzer.histogramEnabled, analyzer.peakingEnabled, analyzer.zebraEnabled]
+    @liveViewPipeline.analyzer = current.any? ? analyzer : nil
+    # 消したものが画面に残らないように一度すべて隠します。残りは次のフレームでまた表示されます。
+    turnedOff = previous.zip(current).any? { |was, now| was && !now }
+    @liveImageView.hideAnalysis if turnedOff
+  end
+
   def toggleFocusMode
     toggleFunction(:toggleFocusModeButton)
   end
@@ -484,11 +615,49 @@ class PhotoViewController < UIViewController
     toggleFunction(:toggleAeLockStateButton)
   end
 
+  # シャッターボタン
+  # 単写もオートブラケット・インターバルタイマーもCaptureSchedulerの撮影計画として撮ります。
+  def releaseShutter
+    camera = AppCamera.instance
+    # 撮影計画の途中でもう一度押すと止めます。
+    if camera.runningTakingPluralPictures
+      camera.stopTakingPluralPictures
+      return
+    end
+    actionType = camera.cameraActionType
+    case actionType
+    when 'AppCameraActionTypeTakingPictureSingle',
+      'AppCameraActionTypeTakingPictureAutoBracketing',
+      'AppCameraActionTypeTakingPictureIntervalTimer',
+      'AppCameraActionTypeTakingPictureCombination'
+      weakSelf = WeakRef.new(self)
+      camera.startTakingPluralPictures(nil, progressHandler:nil, completionHandler:->(stats) {
+        dp "撮影: shots=#{stats[:shots]}, skipped=#{stats[:skippedTicks]}, jitter(rms)=#{(stats[:jitterRms] * 1000).round(1)}ms, drift=#{(stats[:drift] * 1000).round(1)}ms, #{stats[:shotsPerMinute].round(1)}shots/min"
+      }, errorHandler:->(error) {
+        message = error.respond_to?(:localizedDescription) ? error.localizedDescription : error.to_s
+        weakSelf.alertOnMainThreadWithMessage(message, title:"CouldNotTakePicture")
+      })
+    else
+      dp "actionType=#{actionType}のシャッターはまだ扱えません。"
+    end
+  end
+
+  # 撮影用のキューとは別の転送用のキューから呼び出されます。保存し終えるまで待ちます。
+  def saveCapturedImage(data, metadata)
+    semaphore = Dispatch::Semaphore.new(0)
+    @assetsLibrary.writeImageDataToSavedPhotosAlbum(data, metadata:metadata, completionBlock:->(assetURL, error) {
+      dp "保存できませんでした。error=#{error}" if error
+      semaphore.signal
+    })
+    semaphore.wait(SAVE_TIMEOUT)
+  end
+
   def toggleFunction(key)
     camera = AppCamera.instance
     error = Pointer.new(:object)
     toggler = TOGGLERS[key]
-    index = case camera.cameraPropertyValue(toggler[:propertyName], error:nil)
+    # 手元の値で判断するので、押すたびにカメラへ問い合わせることはありません。
+    index = case camera.propertyCache.valueForName(toggler[:propertyName])
     when toggler[:values][1]
       0
     when toggler[:values][0]
@@ -498,7 +667,9 @@ class PhotoViewController < UIViewController
       return false
     end
     result = if key == :toggleAeLockStateButton
-      (index == 0) ? camera.unlockAutoExposure(error) : camera.lockAutoExposure(error)
+      locked = (index == 0) ? camera.unlockAutoExposure(error) : camera.lockAutoExposure(error)
+      camera.propertyCache.store(toggler[:propertyName], toggler[:values][index], true) if locked
+      locked
     else
       if key == :toggleFocusModeButton
         setting = AppSetting.instance
@@ -507,9 +678,9 @@ class PhotoViewController < UIViewController
         else
           OLYCameraMagnifyingLiveViewScaleX5
         end
-        (index == 1) ? camera.startMagnifyingLiveView(scale, error:error) : camera.stopMagnifyingLiveView(error)
+        (index == 1) ? @magnifyController.start(CGPointMake(0.5, 0.5), scale) : @magnifyController.stop
       end
-      camera.setCameraPropertyValue(toggler[:propertyName], value:toggler[:values][index], error:error)
+      camera.propertyCache.setValues({ toggler[:propertyName] => toggler[:values][index] }, error:error)
     end
     result ? @panelView.updateToggler(key, index) : App.alert("CannotChange #{key} 1")
   end
@@ -122,6 +122,13 @@ class SettingsViewController < UIViewController
   # アプリケーションがバックグラウンドに入る時に呼び出されます。
   def applicationDidEnterBackground(notification)
     # @TODO: このタイミングはカメラ接続を一時停止するために研究の余地があります。
+    # 再生キャッシュの索引を書き出しておきます。
+    PlaybackCache.instance.saveIndex
+    # 開発中はカメラ操作のトレースを書き出しておきます。(chrome://tracing で開けます)
+    unless App::ENV['MOTION_ENV'] == 'release'
+      documents = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, true)[0]
+      AppCameraTrace.instance.writeChromeTrace(documents.stringByAppendingPathComponent('camera_trace.json'))
+    end
   end
 
   # アプリケーションがフォアグラウンドに入る時に呼び出されます。
@@ -302,130 +309,71 @@ class SettingsViewController < UIViewController
 
     # # カメラの電源を投入し接続を開始します。
     # # 作者の環境ではiPhone 4Sだと電源投入から接続確立まで20秒近くかかっています。
+    # MARK: 電源投入とWi-Fi接続の確認は同時に進めます。状態の変化はCameraConnectionStateMachineから届きます。
     weakSelf = WeakRef.new(self)
-    weakSelf.bluetoothConnector.services = OLYCamera.bluetoothServices
-    weakSelf.bluetoothConnector.localName = bluetoothLocalName
     dp '接続開始'
     weakSelf.showProgressWhileExecutingBlock(true) do |progressView|
       dp "weakSelf=#{weakSelf}"
       dp "demandToWakeUpWithUsingBluetooth=#{demandToWakeUpWithUsingBluetooth}"
 
-      # カメラに電源投入を試みます。
-      if demandToWakeUpWithUsingBluetooth
-        # カメラを探します。
-        error_ptr = Pointer.new(:object)
-        if weakSelf.bluetoothConnector.connectionStatus == 'BluetoothConnectionStatusNotFound'
-          unless weakSelf.bluetoothConnector.discoverPeripheral(error_ptr)
-            # カメラが見つかりませんでした。
-            error = error_ptr[0]
-            weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi6")
-            openWifiConfig
-            next #【注】 Obj-c版では`return`と書いているが、rubyではnext
-          end
-        end
-
-        # カメラにBluetooth接続します。
-        if weakSelf.bluetoothConnector.connectionStatus == 'BluetoothConnectionStatusNotConnected'
-          unless weakSelf.bluetoothConnector.connectPeripheral(error_ptr)
-            # カメラにBluetooth接続できませんでした。
-            error = error_ptr[0]
-            weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi7")
-            openWifiConfig
-            next #【注】 Obj-c版では`return`と書いているが、rubyではnext
-          end
-        end
-
-        # カメラの電源を入れます。
-        # MARK: カメラ本体のLEDはすぐに電源オン(青)になるが、この応答が返ってくるまで、10秒とか20秒とか、思っていたよりも時間がかかります。
-        # 作者の環境ではiPhone 4Sだと10秒程度かかっています。
-        # MARK: カメラがUSB経由で給電中だと、wekeupメソッドはタイムアウトエラーが時々発生してしまうようです。
-        weakSelf.reportBlockWakingUp(progressView)
-        @camera.bluetoothPeripheral = weakSelf.bluetoothConnector.peripheral
-        @camera.bluetoothPassword = bluetoothPasscode
-        @camera.bluetoothPrepareForRecordingWhenPowerOn = true
-        wokenUp = @camera.wakeup(error_ptr)
-        unless wokenUp
-          dp "カメラの電源を入れるのに失敗しました。"
-          error = error_ptr[0]
-          if error.domain == OLYCameraErrorDomain && error.code == OLYCameraErrorOperationAborted
-            # MARK: カメラをUSB給電中に電源入れるとその後にWi-Fi接続できるようになるのにもかかわらずエラーが返ってくるようです。
-            #     Error {
-            #         Domain = OLYCameraErrorDomain
-            #         Code = 195887114 (OLYCameraErrorOperationAborted)
-            #         UserInfo = { NSLocalizedDescription=The camera did not respond in time. }
-            #     }
-            dp " エラーにすると使い勝手が悪いので、無視して続行します。"
-            wokenUp = true
-          else
-            weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi8")
-          end
-          openWifiConfig
-        end
-        @camera.bluetoothPeripheral = nil
-        @camera.bluetoothPassword = nil
-
-        # カメラとのBluetooth接続を解除します。
-        # MARK: このタイミングで切断することによって、果たしてWi-FiとBluetoothの電波干渉を避けることができるか?
-        unless weakSelf.bluetoothConnector.disconnectPeripheral(error_ptr)
-          dp "カメラとのBluetooth接続解除に失敗しました。"
-          dp "エラーを無視して続行します。"
+      machine = CameraConnectionStateMachine.new(@camera, weakSelf.wifiConnector, weakSelf.bluetoothConnector)
+      machine.transitionHandler = ->(transition) {
+        case transition[:to]
+        when :wakingUp
+          weakSelf.reportBlockWakingUp(progressView)
+        when :joiningWifi
+          # カメラの電源を入れた後にカメラにアクセスできるWi-Fi接続が有効になるまで待ちます。
+          # MARK: カメラ本体のLEDはすぐに接続中(緑)になるが、iOS側のWi-Fi接続が有効になるまで、10秒とか20秒とか、思っていたよりも時間がかかります。
+          weakSelf.reportBlockConnectingWifi(progressView)
+          Dispatch::Queue.main.async {
+            weakSelf.settingsTable.showWifiSettingCell.detailTextLabel.text = "ConnectingWifi"
+          }
+        when :connecting
+          Dispatch::Queue.main.async {
+            progressView.mode = MBProgressHUDModeIndeterminate
+          }
         end
-        weakSelf.bluetoothConnector.peripheral = nil
-
-        # カメラの電源を入れるのに失敗している場合はここで諦めます。
-        next unless wokenUp #【注】 Obj-c版では`return`と書いているが、rubyではnext
-        # カメラの電源を入れた後にカメラにアクセスできるWi-Fi接続が有効になるまで待ちます。
-        # MARK: カメラ本体のLEDはすぐに接続中(緑)になるが、iOS側のWi-Fi接続が有効になるまで、10秒とか20秒とか、思っていたよりも時間がかかります。
-        # 作者の環境ではiPhone 4Sだと10秒程度かかっています。
-        weakSelf.reportBlockConnectingWifi(progressView)
-        Dispatch::Queue.main.async {
-          weakSelf.settingsTable.showWifiSettingCell.detailTextLabel.text = "ConnectingWifi"
-        }
-        unless weakSelf.wifiConnector.waitForConnected(10.0)
-          # Connecting... を元に戻します。
-          weakSelf.updateSettingsTable(nil)
-          # Wi-Fi接続が有効になりませんでした。
+      }
+      sema = Dispatch::Semaphore.new(0)
+      connected = false
+      machine.completionHandler = ->(succeeded, failure, error) {
+        connected = succeeded
+        sema.signal
+      }
+      machine.start(demandToWakeUpWithUsingBluetooth, bluetoothLocalName:bluetoothLocalName, bluetoothPasscode:bluetoothPasscode)
+      sema.wait
+      dp "transitions=#{machine.transitions.map { |t| "#{t[:to]}@#{'%.3f' % t[:elapsed]}" }.join(', ')}"
+
+      unless connected
+        weakSelf.updateSettingsTable(nil)
+        error = machine.error
+        case machine.failure
+        when :discover
+          # カメラが見つかりませんでした。
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotDiscoverCamera", title:"CouldNotConnectWifi6")
+        when :bluetoothConnect
+          # カメラにBluetooth接続できませんでした。
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotConnectBluetooth", title:"CouldNotConnectWifi7")
+        when :wakeup
+          # カメラの電源を入れられませんでした。
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotWakeUpCamera", title:"CouldNotConnectWifi8")
+        when :wifi
           if weakSelf.wifiConnector.connectionStatus != 'WifiConnectionStatusConnected'
             # カメラにアクセスできるWi-Fi接続は見つかりませんでした。
             weakSelf.alertOnMainThreadWithMessage("CouldNotDiscoverWifiConnection", title:"CouldNotConnectWifi1")
           else # カメラにアクセスできるWi-Fi接続ではありませんでした。(すでに別のアクセスポイントに接続している)
             weakSelf.alertOnMainThreadWithMessage("WifiConnectionIsNotCamera", title:"CouldNotConnectWifi2")
           end
-          openWifiConfig
-          next #【注】 Obj-c版では`return`と書いているが、rubyではnext
+        when :connect
+          dp "カメラにアプリ接続できませんでした。"
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotConnectCamera", title:"CouldNotConnectWifi3")
+        when :changeTime
+          dp "時刻が設定できませんでした。"
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotChangeTime", title:"CouldNotConnectWifi4")
+        when :changeRunMode
+          dp "実行モードを変更できませんでした。"
+          weakSelf.alertOnMainThreadWithMessage(error ? error.localizedDescription : "CouldNotChangeRunMode", title:"CouldNotConnectWifi5")
         end
-
-        # # 電源投入が完了しました。
-        progressView.mode = MBProgressHUDModeIndeterminate
-        dp "To wake the camera up is success."
-      end
-
-      dp "カメラにアプリ接続します。"
-      error_ptr = Pointer.new(:object)
-      unless @camera.connect(OLYCameraConnectionTypeWiFi, error:error_ptr)
-        dp "カメラにアプリ接続できませんでした。"
-        error = error_ptr[0]
-        weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi3")
-        openWifiConfig
-        next #【注】 Obj-c版では`return`と書いているが、rubyではnext
-      end
-
-      dp "スマホの現在時刻をカメラに設定します。"
-      # MARK: 保守モードでは受け付けないのでこのタイミングしかありません。
-      unless @camera.changeTime(Time.now, error:error_ptr)
-        dp "時刻が設定できませんでした。"
-        error = error_ptr[0]
-        weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi4")
-        openWifiConfig
-        next #【注】 Obj-c版では`return`と書いているが、rubyではnext
-      end
-
-      # MARK: 実行モードがスタンドアロンモードのまま放置するとカメラの自動スリープが働いてしまってスタンドアロンモード以外へ変更できなくなってしまうようです。
-      dp "カメラの自動スリープを防止するため、あらかじめ実行モードをスタンドアロンモード以外に変更しておきます。(取り敢えず保守モードへ)"
-      unless @camera.changeRunMode(OLYCameraRunModeMaintenance, error:error_ptr)
-        dp "実行モードを変更できませんでした。"
-        error = error_ptr[0]
-        weakSelf.alertOnMainThreadWithMessage(error.localizedDescription, title:"CouldNotConnectWifi5")
         openWifiConfig
         next #【注】 Obj-c版では`return`と書いているが、rubyではnext
       end
@@ -1,7 +1,13 @@
 class AppCamera < OLYCamera
 
   include DebugConcern
+  include MagnifyingAreaConcern
 
+  attr_accessor :liveViewSizeController
+  attr_reader :propertyCache, :captureScheduler
+  # オートブラケット撮影とインターバルタイマー撮影の設定です。
+  # ブラケットのずらし幅(autoBracketingStep)は1/3段単位、インターバル(intervalTimerTime)は秒です。
+  attr_accessor :autoBracketingMode, :autoBracketingCount, :autoBracketingStep, :intervalTimerMode, :intervalTimerCount, :intervalTimerTime
   attr_accessor :connectionDelegates, :cameraPropertyDelegates, :playbackDelegates, :liveViewDelegates, :recordingDelegates, :recordingSupportsDelegates, :takingPictureDelegates
 
   # OLYCameraLiveViewSizeQVGA    (320×240)
@@ -9,9 +15,10 @@ class AppCamera < OLYCamera
   # OLYCameraLiveViewSizeSVGA    (800×600)
   # OLYCameraLiveViewSizeXGA     (1024×768)
   # OLYCameraLiveViewSizeQuadVGA (1280×960)
+  # 実際のサイズはLiveViewSizeControllerが通信状況に合わせて上げ下げします。
   LIVE_VIEW_SIZES = {
-    normal:  OLYCameraLiveViewSizeVGA, # ふだんはスピード重視の画質
-    magnify: OLYCameraLiveViewSizeXGA  # 拡大ビューのときに画質をよくする
+    normal:  OLYCameraLiveViewSizeVGA, # 撮影モードに入った時の画質
+    magnify: OLYCameraLiveViewSizeXGA  # 拡大ビューのときはこれより画質を下げない
   }
 
   MAGNIFYING_LIVE_VIEW_SCALES = {
@@ -43,6 +50,18 @@ class AppCamera < OLYCamera
     # 'GPS'                             => '<GPS/ON>' なぜか拒否される
   }
 
+  # 撮影モードに入る時にまとめて読み込んでおくプロパティです。
+  CACHED_PROPERTIES = DEFAULT_PROPERTIES.keys | %w(APERTURE SHUTTER AE_LOCK_STATE)
+
+  # 撮影モードを抜ける時に保存して、次に入った時に戻すプロパティです。
+  # MARK: AE_LOCK_STATEは戻しても意味がないので含めません。
+  SNAPSHOT_PROPERTIES = DEFAULT_PROPERTIES.keys | %w(APERTURE SHUTTER)
+
+  # オートブラケット撮影ができる撮影モードです。
+  AUTO_BRACKETING_TAKEMODES = %w(<TAKEMODE/P> <TAKEMODE/A> <TAKEMODE/S> <TAKEMODE/M>)
+  # インターバルタイマー撮影ができる撮影モードです。
+  INTERVAL_TIMER_TAKEMODES = %w(<TAKEMODE/iAuto> <TAKEMODE/P> <TAKEMODE/A> <TAKEMODE/S> <TAKEMODE/M> <TAKEMODE/ART>)
+
   # Rubymotionではシングルトンモジュールが使えない
   def self.instance
     Dispatch.once { @@instance ||= alloc.init }
@@ -59,6 +78,22 @@ class AppCamera < OLYCamera
       @recordingSupportsDelegates = []#WeakRef.new(Array.new)
       @takingPictureDelegates     = []#WeakRef.new(Array.new)
 
+      # ライブビューのサイズは受信状況を見ながら別キューで変更します。
+      @liveViewSizeController = LiveViewSizeController.new
+      @liveViewSizeQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.AppCamera.liveViewSize")
+
+      # カメラプロパティの値は手元に持っておき、変わったものだけを書き込みます。
+      @propertyCache = CameraPropertyCache.new(self)
+
+      # オートブラケット撮影とインターバルタイマー撮影は、アプリがシャッターを切る時刻を決めて行います。
+      @captureScheduler = CaptureScheduler.new(self)
+      @autoBracketingMode = 'AppCameraAutoBracketingModeDisabled'
+      @autoBracketingCount = 3
+      @autoBracketingStep = 3
+      @intervalTimerMode = 'AppCameraIntervalTimerModeDisabled'
+      @intervalTimerCount = 10
+      @intervalTimerTime = 5.0
+
       self.connectionDelegate = self
       self.cameraPropertyDelegate = self
       self.playbackDelegate = self
@@ -69,14 +104,34 @@ class AppCamera < OLYCamera
     self
   end
 
-  def init_properties
+  # 撮影モードに入った時に呼び出します。snapshotがあればその値に戻します。
+  # 今の値を1回でまとめて読み込んでから、違っているものだけを1回でまとめて書き込みます。
+  def init_properties(snapshot, exclude:exclude)
     error = Pointer.new(:object)
-    unless self.setCameraPropertyValues(DEFAULT_PROPERTIES, error:error)
+    @propertyCache.valuesForNames(CACHED_PROPERTIES)
+    values = DEFAULT_PROPERTIES.merge(snapshot || {}).reject { |name, value| exclude.include?(name) }
+    # 撮影モードによって書き込めるプロパティが変わるので、撮影モードを先に書き込みます。
+    takeMode = values.select { |name, value| name == 'TAKEMODE' }
+    succeeded = @propertyCache.setValues(takeMode, error:error)
+    # 今の撮影モードで読み出し専用のもの(PモードのAPERTUREやSHUTTERなど)は拒否されるとわかっているので送りません。
+    others = values.reject { |name, value| name == 'TAKEMODE' }
+    settable = @propertyCache.settableValues(others)
+    dp "読み出し専用なので戻さないプロパティ: #{others.keys - settable.keys}" if settable.size < others.size
+    succeeded = @propertyCache.setValues(settable, error:error) && succeeded
+    unless succeeded
       alertOnMainThreadWithMessage(error[0].localizedDescription, title:"FailedSetProperties")
     end
-    unless self.changeLiveViewSize(LIVE_VIEW_SIZES[:normal], error:error)
-      alertOnMainThreadWithMessage(error[0].localizedDescription, title:"FailedSetLiveViewSize")
-    end
+    # ライブビューの受信で計測しているのと同じキューで、計測をやり直します。
+    @liveViewSizeQueue.sync {
+      unless changeLiveViewSizeIfNeeded(@liveViewSizeController.reset(LIVE_VIEW_SIZES[:normal]), error)
+        alertOnMainThreadWithMessage(error[0].localizedDescription, title:"FailedSetLiveViewSize")
+      end
+    }
+  end
+
+  # 今のカメラ設定のスナップショットを取ります。手元にある値はカメラに問い合わせません。
+  def snapshotOfSetting
+    @propertyCache.snapshot(SNAPSHOT_PROPERTIES)
   end
 
   # delegate
@@ -222,11 +277,39 @@ class AppCamera < OLYCamera
     #
     # デリゲート集合のそれぞれにイベントを伝達します。
     # delegates.each do |delegate|
-    @liveViewDelegates.each do |delegate|
+    # MARK: デリゲートは重い処理をせずにすぐ戻る前提です。(PhotoViewControllerはLiveViewPipelineに渡すだけ)
+    @liveViewDelegates.dup.each do |delegate|
       if delegate.respondsToSelector('camera:didUpdateLiveView:metadata:')
         delegate.camera(camera, didUpdateLiveView:data, metadata:metadata)
       end
     end
+
+    # 受信間隔とデータ量から、ライブビューのサイズを変えるべきか判断します。
+    receivedAt = CACurrentMediaTime()
+    bytes = data.length
+    @liveViewSizeQueue.async {
+      size = @liveViewSizeController.observeArrival(receivedAt, bytes)
+      changeLiveViewSizeIfNeeded(size)
+    }
+  end
+
+  # ライブビューのデコードに要した時間を報告してもらいます。
+  def reportLiveViewDecodeTime(duration)
+    @liveViewSizeQueue.async {
+      @liveViewSizeController.observeDecode(duration)
+    }
+  end
+
+  # 書き込めた時だけ、LiveViewSizeControllerの今のサイズを変えます。(@liveViewSizeQueueから呼び出します)
+  def changeLiveViewSizeIfNeeded(size, error = Pointer.new(:object))
+    return true unless size
+    unless self.changeLiveViewSize(size, error:error)
+      dp "ライブビューのサイズを変更できませんでした。error=#{error[0]}"
+      @liveViewSizeController.reject(size)
+      return false
+    end
+    @liveViewSizeController.commit(size)
+    true
   end
 
   def cameraActionStatus
@@ -275,33 +358,9 @@ class AppCamera < OLYCamera
       return 'AppCameraActionTypeUnknown'
     end
 
-    # # オートブラケット撮影が有効か検査します。
-    autoBracketingModeEnabled = false
-    # if self.autoBracketingMode != 'AppCameraAutoBracketingModeDisabled'
-    #   error = Pointer.new(:object)
-    #   takemode = cameraPropertyValue(CameraPropertyTakemode, error:error)
-    #   if takemode.isEqualToString(CameraPropertyValueTakemodeP) ||
-    #     takemode.isEqualToString(CameraPropertyValueTakemodeA) ||
-    #     takemode.isEqualToString(CameraPropertyValueTakemodeS) ||
-    #     takemode.isEqualToString(CameraPropertyValueTakemodeM]) {
-    #     autoBracketingModeEnabled = true
-    #   }
-    # }
-
-    # # インターバルタイマー撮影が有効か検査します。
-    intervalTimerModeEnabled = false
-    # if (self.intervalTimerMode != AppCameraIntervalTimerModeDisabled) {
-    #   NSError *error = nil;
-    #   NSString *takemode = [super cameraPropertyValue:CameraPropertyTakemode error:&error];
-    #   if ([takemode isEqualToString:CameraPropertyValueTakemodeIAuto] ||
-    #     [takemode isEqualToString:CameraPropertyValueTakemodeP] ||
-    #     [takemode isEqualToString:CameraPropertyValueTakemodeA] ||
-    #     [takemode isEqualToString:CameraPropertyValueTakemodeS] ||
-    #     [takemode isEqualToString:CameraPropertyValueTakemodeM] ||
-    #     [takemode isEqualToString:CameraPropertyValueTakemodeArt]) {
-    #     intervalTimerModeEnabled = true
-    #   }
-    # }
+    # オートブラケット撮影とインターバルタイマー撮影が有効か検査します。
+    autoBracketingModeEnabled = self.autoBracketingModeEnabled
+    intervalTimerModeEnabled = self.intervalTimerModeEnabled
 
     # 撮影モードを総合的に判断します。
     if autoBracketingModeEnabled && intervalTimerModeEnabled
@@ -314,6 +373,62 @@ class AppCamera < OLYCamera
     return 'AppCameraActionTypeTakingPictureSingle'
   end
 
+  # オートブラケット撮影が有効で、今の撮影モードで使えるかどうかです。撮影モードは手元の値で判断します。
+  def autoBracketingModeEnabled
+    return false if @autoBracketingMode == 'AppCameraAutoBracketingModeDisabled'
+    AUTO_BRACKETING_TAKEMODES.include?(@propertyCache.valueForName('TAKEMODE'))
+  end
+
+  # インターバルタイマー撮影が有効で、今の撮影モードで使えるかどうかです。
+  def intervalTimerModeEnabled
+    return false if @intervalTimerMode == 'AppCameraIntervalTimerModeDisabled'
+    INTERVAL_TIMER_TAKEMODES.include?(@propertyCache.valueForName('TAKEMODE'))
+  end
+
+  #
+  # オートブラケット＋インターバルタイマー撮影
+  #
+  def runningTakingPluralPictures
+    @captureScheduler.running
+  end
+
+  # 今の設定から撮影計画を作ります。
+  def pluralPicturesPlan
+    bracket = self.autoBracketingModeEnabled ? CaptureScheduler.bracketOf(@autoBracketingCount, @autoBracketingStep) : [0]
+    if self.intervalTimerModeEnabled
+      CaptureScheduler.plan(@intervalTimerCount, @intervalTimerTime, bracket)
+    else
+      CaptureScheduler.plan(1, 0.0, bracket)
+    end
+  end
+
+  # 撮影計画に従って撮影を始めます。optionsは1枚ごとのtakePictureに渡します。ハンドラーは撮影用のキューから呼び出されます。
+  def startTakingPluralPictures(options, progressHandler:progressHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+    plan = pluralPicturesPlan.merge(options: options)
+    dp "plan=#{plan}"
+    @captureScheduler.start(plan, progressHandler:progressHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+  end
+
+  def stopTakingPluralPictures
+    @captureScheduler.stop
+  end
+
+  def camera(camera, didReceiveCapturedImagePreview:data, metadata:metadata)
+    # MARK: このデリゲートはカメラキットのスレッドから呼び出されます。保存は撮影と並行して別キューで行います。
+    @captureScheduler.receiveCapturedImage(data, metadata)
+    @recordingSupportsDelegates.dup.each do |delegate|
+      if delegate.respondsToSelector('camera:didReceiveCapturedImagePreview:metadata:')
+        delegate.camera(camera, didReceiveCapturedImagePreview:data, metadata:metadata)
+      end
+    end
+  end
+
+  def camera(camera, didChangeCameraProperty:name)
+    # 手元の値は古くなったことにして、次に読む時に問い合わせ直します。
+    @propertyCache.invalidate(name)
+    camera(camera, notifyDidChangeCameraProperty:name, sender:nil)
+  end
+
   def camera(camera, notifyDidChangeCameraProperty:name, sender:sender)
     # for (id<OLYCameraPropertyDelegate> delegate in self.cameraPropertyDelegates) {
     @cameraPropertyDelegates.each do |delegate|
@@ -324,72 +439,86 @@ class AppCamera < OLYCamera
     end
   end
 
+  #
+  # トレース
+  #
+  # 時間のかかるカメラ操作の区間をAppCameraTraceに記録します。
+  # MARK: ブロックの中からsuperを呼ぶのは避けて、startとfinishで挟みます。
+  def connect(connectionType, error:error)
+    span = AppCameraTrace.instance.start("connect #{connectionType}")
+    # 前の接続で読み込んだ値は当てにならないので捨てます。
+    @propertyCache.clear
+    resetMagnifyingArea(true)
+    result = super(connectionType, error:error)
+    AppCameraTrace.instance.finish(span)
+    result
+  end
+
+  def changeRunMode(mode, error:error)
+    span = AppCameraTrace.instance.start("changeRunMode #{mode}")
+    result = super(mode, error:error)
+    AppCameraTrace.instance.finish(span)
+    result
+  end
+
+  def startLiveView(error)
+    span = AppCameraTrace.instance.start('startLiveView')
+    result = super(error)
+    AppCameraTrace.instance.finish(span)
+    result
+  end
+
+  def takePicture(options, progressHandler:progressHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+    span = AppCameraTrace.instance.start('takePicture')
+    super(options, progressHandler:progressHandler, completionHandler:->(info) {
+      AppCameraTrace.instance.finish(span)
+      completionHandler.call(info) if completionHandler
+    }, errorHandler:->(error) {
+      AppCameraTrace.instance.finish(span.merge(name: 'takePicture (failed)'))
+      errorHandler.call(error) if errorHandler
+    })
+  end
+
   #
   # 拡大ビュー
   #
+  # 表示範囲はMagnifyingAreaConcernで手元で計算し、カメラには問い合わせません。
+  # 実際の表示範囲が必要になったらsyncMagnifyingLiveViewAreaで1回だけ問い合わせます。
+  # MARK: ライブビューのサイズ変更は待たずに別キューに任せます。拡大の操作が後ろで待たされないようにするためです。
   def startMagnifyingLiveView(scale, error:error)
     dp "scale=#{scale}"
-    # ライブビュー拡大が成功したらその時の倍率と表示範囲を保持しておきます。
     return false unless super(scale, error:error)
-    area = magnifyingLiveViewArea(error)
-    return false if !area[OLYCameraMagnifyingOverallViewSizeKey] || !area[OLYCameraMagnifyingDisplayAreaRectKey]
-    overallViewSize = area[OLYCameraMagnifyingOverallViewSizeKey]# CGSizeValue];
-    displayAreaRect = area[OLYCameraMagnifyingDisplayAreaRectKey]# CGRectValue];
-    # MARK: 設定する順序がシビア。今このアプリでは、magnifyingLiveViewScaleをKVOしているので、それを一番最後に変更します。
-    @magnifyingOverallViewSize = overallViewSize
-    @magnifyingDisplayAreaRect = displayAreaRect
-    @magnifyingLiveViewScale = scale
-    self.changeLiveViewSize(LIVE_VIEW_SIZES[:magnify], error:error) # ライブビューの画質を上げる
+    # どこが拡大されたかは分からないので、この時だけ問い合わせます。
+    trackMagnifyingStart(CGPointMake(0.5, 0.5), scale)
+    syncMagnifyingLiveViewArea(error)
+    startMagnifyingLiveViewSize unless @restartingMagnifying
     return true
   end
 
   def startMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
-    dp "scale=#{scale}"
-    # ライブビュー拡大が成功したらその時の倍率と表示範囲を保持しておきます。
+    dp "point=#{point.x},#{point.y}, scale=#{scale}"
     return false unless super(point, scale:scale, error:error)
-    area = magnifyingLiveViewArea(error)
-    return false if !area[OLYCameraMagnifyingOverallViewSizeKey] || !area[OLYCameraMagnifyingDisplayAreaRectKey]
-    overallViewSize = area[OLYCameraMagnifyingOverallViewSizeKey]# CGSizeValue];
-    displayAreaRect = area[OLYCameraMagnifyingDisplayAreaRectKey]# CGRectValue];
-    # MARK: 設定する順序がシビア。今このアプリでは、magnifyingLiveViewScaleをKVOしているので、それを一番最後に変更します。
-    @magnifyingOverallViewSize = overallViewSize
-    @magnifyingDisplayAreaRect = displayAreaRect
-    @magnifyingLiveViewScale = scale
-    self.changeLiveViewSize(LIVE_VIEW_SIZES[:magnify], error:error) # ライブビューの画質を上げる
+    trackMagnifyingStart(point, scale)
+    startMagnifyingLiveViewSize unless @restartingMagnifying
     return true
   end
 
   def changeMagnifyingLiveViewScale(scale, error:error)
     dp "scale=#{scale}"
     # ライブビュー拡大を開始していない場合は変更されたことにします。
-    unless @magnifyingLiveView
+    unless self.magnifyingLiveView
       @magnifyingLiveViewScale = scale
       return true
     end
-    # ライブビュー拡大の倍率変更が成功したらその時の倍率と表示範囲を保持しておきます。
     return false unless super(scale, error:error)
-    area = magnifyingLiveViewArea(error)
-    return false if !area[OLYCameraMagnifyingOverallViewSizeKey] || !area[OLYCameraMagnifyingDisplayAreaRectKey]
-    overallViewSize = area[OLYCameraMagnifyingOverallViewSizeKey]# CGSizeValue];
-    displayAreaRect = area[OLYCameraMagnifyingDisplayAreaRectKey]# CGRectValue];
-    # MARK: 設定する順序がシビア。今このアプリでは、magnifyingLiveViewScaleをKVOしているので、それを一番最後に変更します。
-    @magnifyingOverallViewSize = overallViewSize
-    @magnifyingDisplayAreaRect = displayAreaRect
-    @magnifyingLiveViewScale = scale
+    trackMagnifyingScale(scale)
     return true
   end
 
   def changeMagnifyingLiveViewArea(direction, error:error)
     dp "direction=#{direction}"
-    # ライブビュー拡大の表示範囲移動が成功したらその時の表示範囲を保持しておきます。
     return false unless super(direction, error:error)
-    area = magnifyingLiveViewArea(error)
-    return false if !area[OLYCameraMagnifyingOverallViewSizeKey] || !area[OLYCameraMagnifyingDisplayAreaRectKey]
-    overallViewSize = area[OLYCameraMagnifyingOverallViewSizeKey]# CGSizeValue];
-    displayAreaRect = area[OLYCameraMagnifyingDisplayAreaRectKey]# CGRectValue];
-    # MARK: 設定する順序がシビア。今このアプリでは、magnifyingLiveViewScaleをKVOしているので、それを一番最後に変更します。
-    @magnifyingOverallViewSize = overallViewSize
-    @magnifyingDisplayAreaRect = displayAreaRect
+    trackMagnifyingScroll(direction)
     return true
   end
 
@@ -397,11 +526,52 @@ class AppCamera < OLYCamera
     # ライブビュー拡大を止めます。
     return false unless super(error)
     # ライブビュー拡大の表示範囲を初期化しておきます。
-    @magnifyingOverallViewSize = CGSizeZero
-    @magnifyingDisplayAreaRect = CGRectZero
-    self.changeLiveViewSize(LIVE_VIEW_SIZES[:normal], error:error) # ライブビューの画質を戻す
+    resetMagnifyingArea
+    stopMagnifyingLiveViewSize unless @restartingMagnifying
     return true
   end
 
+  # 拡大したまま別の場所へ大きく移動する時は、表示範囲移動を重ねるより止めて拡大し直す方が早く済みます。
+  # その間はライブビューのサイズを変えません。
+  def restartMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
+    @restartingMagnifying = true
+    wasMagnifying = self.magnifyingLiveView
+    stopped = false
+    started = false
+    begin
+      return false if wasMagnifying && !(stopped = stopMagnifyingLiveView(error))
+      started = startMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
+      return started
+    ensure
+      @restartingMagnifying = false
+      # 止めた後に拡大し直せなかった時は、拡大ビュー用のサイズの下限も外します。
+      stopMagnifyingLiveViewSize if stopped && !started
+      # 拡大していなかったところから拡大した時は、下限を上げます。
+      startMagnifyingLiveViewSize if !wasMagnifying && started
+    end
+  end
+
+  # カメラに表示範囲を問い合わせて、手元で計算した値を正します。
+  def syncMagnifyingLiveViewArea(error)
+    area = magnifyingLiveViewArea(error)
+    trackMagnifyingArea(area)
+  end
+
+  private
+
+  def startMagnifyingLiveViewSize
+    # ライブビューの画質を拡大ビュー用の下限まで上げる
+    @liveViewSizeQueue.async {
+      changeLiveViewSizeIfNeeded(@liveViewSizeController.startMagnifying(LIVE_VIEW_SIZES[:magnify]))
+    }
+  end
+
+  def stopMagnifyingLiveViewSize
+    # ライブビューの画質を拡大前に戻す
+    @liveViewSizeQueue.async {
+      changeLiveViewSizeIfNeeded(@liveViewSizeController.stopMagnifying)
+    }
+  end
+
 end
 
@@ -1,39 +1,64 @@
 class AppCameraLog
 
+  # 保持するログの件数です。これを超えたら古いものから捨てます。
+  CAPACITY = 4096
+
+  attr_reader :buffer
+
   # Rubymotionではシングルトンモジュールが使えない
   def self.instance
-    Dispatch.once { @@instance ||= alloc.init }
+    Dispatch.once {
+      @@instance ||= alloc.init
+      @@instance.register
+    }
     @@instance
   end
 
   def init()
     if super
-      @mutableMessages = []
-      OLYCameraLog.setDelegate(self)
+      @buffer = TraceRingBuffer.new(CAPACITY)
+      # 単調増加の時刻を実時刻に直すための差分です。
+      @wallClockOffset = NSDate.date.timeIntervalSince1970 - CACurrentMediaTime()
+      @formatter = NSDateFormatter.alloc.init
+      @formatter.setTimeZone(NSTimeZone.localTimeZone)
+      @formatter.setDateFormat("HH:mm:ss.SSS")
+      @formatterQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.AppCameraLog.formatter")
     end
     self
   end
 
+  # カメラキットのログを受け取るようにします。(instanceからだけ呼び出します)
+  def register
+    OLYCameraLog.setDelegate(self)
+  end
+
+  # ログ履歴を古い順に整形して返します。
   def messages
-    @mutableMessages.dup
+    result = []
+    # MARK: NSDateFormatterはスレッドセーフではないので、整形は1本のキューで行います。
+    @formatterQueue.sync {
+      @buffer.each do |time, duration, level, message|
+        timestamp = @formatter.stringFromDate(NSDate.dateWithTimeIntervalSince1970(@wallClockOffset + time))
+        result << "#{timestamp} #{message}"
+      end
+    }
+    result
   end
 
   def clearMessages
-    @mutableMessages = []
+    @buffer.clear
     true
   end
 
+  # 単調増加の時刻を実時刻(UNIX時間)に直します。
+  def wallClockTime(time)
+    @wallClockOffset + time
+  end
+
   # カメラキットがログに出力しようとしたときに呼び出されます。
+  # MARK: カメラキットの色々なスレッドから呼び出されるので、ここでは時刻と参照を記録するだけにします。
   def log(log, shouldOutputMessage:message, level:level)
-    # ログファイル用のメッセージを作成します。
-    currentTime = Time.now
-    formatter = NSDateFormatter.alloc.init
-    formatter.setTimeZone(NSTimeZone.localTimeZone)
-    formatter.setDateFormat("HH:mm:ss.SSS")
-    loggingTimestamp = formatter.stringFromDate(currentTime)
-    loggingMessage = "#{loggingTimestamp} #{message}"
-    # ログ履歴に記録します。
-    @mutableMessages << loggingMessage
+    @buffer.append(CACurrentMediaTime(), 0.0, level, message)
   end
 
 end
@@ -0,0 +1,83 @@
+class AppCameraTrace
+
+  # 保持する区間の件数です。
+  CAPACITY = 2048
+  # Chromeのトレース(chrome://tracing や Perfetto)で開ける形式で書き出します。
+  PROCESS_ID = 1
+
+  attr_reader :buffer
+
+  # Rubymotionではシングルトンモジュールが使えない
+  def self.instance
+    Dispatch.once { @@instance ||= alloc.init }
+    @@instance
+  end
+
+  def init()
+    if super
+      @buffer = TraceRingBuffer.new(CAPACITY)
+    end
+    self
+  end
+
+  # ブロックの実行にかかった区間を記録して、ブロックの値を返します。
+  def measure(name)
+    startTime = CACurrentMediaTime()
+    begin
+      yield
+    ensure
+      @buffer.append(startTime, CACurrentMediaTime() - startTime, currentThreadId, name)
+    end
+  end
+
+  # 完了ハンドラで終わる処理のように、ブロックで囲めない区間の始まりです。
+  # 戻り値をfinishに渡して区間を閉じます。
+  def start(name)
+    { name: name, startTime: CACurrentMediaTime(), threadId: currentThreadId }
+  end
+
+  def finish(span)
+    @buffer.append(span[:startTime], CACurrentMediaTime() - span[:startTime], span[:threadId], span[:name])
+  end
+
+  def clear
+    @buffer.clear
+  end
+
+  # 記録した区間をChromeのトレースイベントの配列にします。時刻の単位はマイクロ秒です。
+  # カメラキットのログも一緒に瞬間イベントとして並べます。
+  def chromeTraceEvents(includeLog = true)
+    events = []
+    @buffer.each do |time, duration, threadId, name|
+      events << { 'name' => name, 'cat' => 'camera', 'ph' => 'X', 'ts' => microseconds(time), 'dur' => microseconds(duration), 'pid' => PROCESS_ID, 'tid' => threadId }
+    end
+    if includeLog
+      AppCameraLog.instance.buffer.each do |time, duration, level, message|
+        events << { 'name' => message.to_s, 'cat' => 'log', 'ph' => 'i', 's' => 'p', 'ts' => microseconds(time), 'pid' => PROCESS_ID, 'tid' => 0, 'args' => { 'level' => level } }
+      end
+    end
+    events.sort_by { |event| event['ts'] }
+  end
+
+  def chromeTraceData(includeLog = true)
+    trace = { 'traceEvents' => chromeTraceEvents(includeLog), 'displayTimeUnit' => 'ms' }
+    NSJSONSerialization.dataWithJSONObject(trace, options:0, error:nil)
+  end
+
+  def writeChromeTrace(path, includeLog = true)
+    data = chromeTraceData(includeLog)
+    data ? data.writeToFile(path, options:NSDataWritingAtomic, error:nil) : false
+  end
+
+  private
+
+  def microseconds(seconds)
+    (seconds * 1_000_000).round
+  end
+
+  # トレースの行を分けるためのスレッドの番号です。メインスレッドは1にします。
+  def currentThreadId
+    NSThread.isMainThread ? 1 : NSThread.currentThread.hash & 0x7fffffff
+  end
+
+end
@@ -30,6 +30,10 @@ class BluetoothConnector
     # https://groups.google.com/forum/#!topic/rubymotion/ja1HGzqPbF8
     # をみて↓のようにしてみた
     queue = Dispatch::Queue.concurrent("#{App::ENV['APP_IDENTIFIER']}.BluetoothConnector.queue").dispatch_object
+    # デリゲートに届いた知らせを待っているセマフォです。(待つ処理はポーリングしません)
+    @waiters = []
+    @waitersQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.BluetoothConnector.waiters")
+    @connectionFailed = false
     @centralManager = CBCentralManager.alloc.initWithDelegate(self, queue:queue)
   end
 
@@ -51,6 +55,7 @@ class BluetoothConnector
   end
 
   def discoverPeripheral(error)
+    @waitCancelled = false
     if @running
       dp "すでに実行中です。"
       internalError = createError(BluetoothConnectorErrorBusy, description:"DiscorverPeripheralIsRunnning")
@@ -60,10 +65,7 @@ class BluetoothConnector
     end
 
     # MARK: セントラルマネージャを生成してすぐにステータスを参照するとまだ電源オンしていない場合があります。
-    managerStartTime = Time.now
-    while (@centralManager.state != CBCentralManagerStatePoweredOn && Time.now - managerStartTime < @timeout)
-      sleep(0.05)
-    end
+    waitUntil(@timeout) { @centralManager.state == CBCentralManagerStatePoweredOn }
     if @centralManager.state != CBCentralManagerStatePoweredOn
       dp "Bluetoothデバイスは利用できません。"
       internalError = createError(BluetoothConnectorErrorNotAvailable, description:"CBCentralManagerStateNotPoweredOn")
@@ -86,10 +88,7 @@ class BluetoothConnector
     @centralManager.stopScan
     scanOptions = { CBCentralManagerScanOptionAllowDuplicatesKey => false }
     @centralManager.scanForPeripheralsWithServices(@services, options:scanOptions)
-    scanStartTime = Time.now
-    while (!@peripheral && Time.now - scanStartTime < @timeout)
-      sleep(0.05)
-    end
+    waitUntil(@timeout) { @peripheral != nil }
     @centralManager.stopScan
     discovered = (@peripheral != nil)
     @running = false
@@ -107,25 +106,23 @@ class BluetoothConnector
   end
 
   def connectPeripheral(error)
+    @waitCancelled = false
     if @running
       dp "すでに実行中です。"
       internalError = createError(BluetoothConnectorErrorBusy, description:"ConnectPeripheralIsRunnning")
       dp "error=#{internalError}"
       error[0] = internalError if error
-      false
+      return false
     end
 
     # MARK: セントラルマネージャを生成してすぐにステータスを参照するとまだ電源オンしていない場合があります。
-    managerStartTime = Time.now
-    while (@centralManager.state != CBCentralManagerStatePoweredOn && Time.now - managerStartTime < @timeout)
-      sleep(0.05)
-    end
+    waitUntil(@timeout) { @centralManager.state == CBCentralManagerStatePoweredOn }
     if @centralManager.state != CBCentralManagerStatePoweredOn
       dp "Bluetoothデバイスは利用できません。"
       internalError = createError(BluetoothConnectorErrorNotAvailable, description:"CBCentralManagerStateNotPoweredOn")
       dp "error=#{internalError}"
       error[0] = internalError if error
-      false
+      return false
     end
 
     unless @peripheral
@@ -133,7 +130,7 @@ class BluetoothConnector
       internalError = createError(BluetoothConnectorErrorNoPeripheral, description:"NoBluetoothPeripherals")
       dp "error=#{internalError}"
       error[0] = internalError if error
-      false
+      return false
     end
 
     if @peripheral && @peripheral.name == @localName && @peripheral.state == CBPeripheralStateConnected
@@ -146,16 +143,14 @@ class BluetoothConnector
 
     dp "ペリフェラルに接続します。"
     @running = true
+    @connectionFailed = false
     connectOptions = {
       CBConnectPeripheralOptionNotifyOnConnectionKey    => false,
       CBConnectPeripheralOptionNotifyOnDisconnectionKey => false,
       CBConnectPeripheralOptionNotifyOnNotificationKey  => false
     }
     @centralManager.connectPeripheral(@peripheral, options:connectOptions)
-    scanStartTime = Time.now
-    while (@peripheral.state != CBPeripheralStateConnected && Time.now - scanStartTime < @timeout)
-      sleep(0.05)
-    end
+    waitUntil(@timeout) { @peripheral.state == CBPeripheralStateConnected || @connectionFailed }
     connected = (@peripheral.state == CBPeripheralStateConnected)
     @running = false
 
@@ -174,6 +169,7 @@ class BluetoothConnector
   end
 
   def disconnectPeripheral(error)
+    @waitCancelled = false
     if @running
       # すでに実行中です。
       internalError = createError('BluetoothConnectorErrorBusy', description:"DisconnectPeripheralIsRunnning")
@@ -209,10 +205,7 @@ class BluetoothConnector
     # ペリフェラルの接続を解除します。
     @running = true
     @centralManager.cancelPeripheralConnection(@peripheral)
-    scanStartTime = Time.now
-    while (@peripheral.state != CBPeripheralStateDisconnected && Time.now - scanStartTime < @timeout)
-      sleep(0.05)
-    end
+    waitUntil(@timeout) { @peripheral.state == CBPeripheralStateDisconnected }
     disconnected = (@peripheral.state == CBPeripheralStateDisconnected)
     @running = false
 
@@ -249,6 +242,7 @@ class BluetoothConnector
     end
     dp "central.state=#{state}"
 
+    signalWaiters
     notificationCenter = NSNotificationCenter.defaultCenter
     notificationCenter.postNotificationName(BluetoothConnectionChangedNotification, object:self)
   end
@@ -260,6 +254,7 @@ class BluetoothConnector
     if advertisementData[CBAdvertisementDataLocalNameKey] == @localName
       @peripheral = peripheral
       @centralManager.stopScan
+      signalWaiters
       dp "peripheral.name=#{peripheral.name}"
       dp "peripheral.class=#{peripheral.class}"
       # camera = OLYCamera.new
@@ -272,16 +267,20 @@ class BluetoothConnector
   # ペリフェラルに接続した時に呼び出されます。
   def centralManager(central, didConnectPeripheral:peripheral)
     dp "接続しました　peripheral=#{peripheral}"
+    signalWaiters
   end
 
   # ペリフェラルに接続失敗した時に呼び出されます。
   def centralManager(central, didFailToConnectPeripheral:peripheral, error:error)
     dp "接続失敗しました　peripheral=#{peripheral}"
+    @connectionFailed = true
+    signalWaiters
   end
 
   # ペリフェラルの接続が解除された時に呼び出されます。
   def centralManager(central, didDisconnectPeripheral:peripheral, error:error)
     dp "接続解除しました　peripheral=#{peripheral}"
+    signalWaiters
 
     # 切断処理中以外にBluetoothの切断通知を受けた場合は、ここからさらに通知します。
     unless @running
@@ -290,6 +289,35 @@ class BluetoothConnector
     end
   end
 
+  # 検索や接続を待っているところを打ち切ります。(接続を中止した時など)
+  def cancelWaiting
+    @waitCancelled = true
+    signalWaiters
+  end
+
+  # 条件が満たされるまで、デリゲートに知らせが届くたびに確かめながら待ちます。
+  def waitUntil(timeout, &condition)
+    return true if condition.call
+    sema = Dispatch::Semaphore.new(0)
+    @waitersQueue.sync { @waiters << sema }
+    # 登録する前に知らせが届いていた場合に備えて、もう一度確かめます。
+    satisfied = condition.call
+    deadline = CACurrentMediaTime() + timeout
+    until satisfied
+      remaining = deadline - CACurrentMediaTime()
+      break if remaining <= 0 || !sema.wait(remaining) || @waitCancelled
+      satisfied = condition.call
+    end
+    @waitersQueue.sync { @waiters.delete(sema) }
+    satisfied
+  end
+
+  def signalWaiters
+    waiters = nil
+    @waitersQueue.sync { waiters = @waiters.dup }
+    waiters.each { |sema| sema.signal }
+  end
+
   # エラー情報を作成します。
   def createError(code, description:description)
     dp "code=#{code}, description=#{description}"
@@ -0,0 +1,277 @@
+class CameraConnectionStateMachine
+
+  include DebugConcern
+
+  # カメラにアクセスできるWi-Fi接続が有効になるまで待つ秒数です。
+  WIFI_TIMEOUT = 10.0
+  # Bluetoothで電源を入れる場合は、その応答を待つ時間も加えます。
+  # MARK: カメラ本体のLEDはすぐに電源オン(青)になるが、wakeupの応答が返ってくるまで10秒とか20秒とかかかります。
+  WAKEUP_TIMEOUT = 30.0
+
+  # 状態
+  #   idle        ... 開始前
+  #   wakingUp    ... Bluetoothで電源を入れている(同時にWi-Fi接続の確認も進めている)
+  #   joiningWifi ... カメラにアクセスできるWi-Fi接続が有効になるのを待っている
+  #   connecting  ... カメラにアプリ接続している
+  #   configuring ... 時刻と実行モードを設定している
+  #   connected   ... 接続完了
+  #   failed      ... 失敗 (failureに理由が入ります)
+  #   cancelled   ... 中止
+  # 失敗の理由
+  #   discover, bluetoothConnect, wakeup ... Bluetoothでカメラを探す・接続する・電源を入れるのに失敗した
+  #   wifi ... カメラにアクセスできるWi-Fi接続が有効にならなかった
+  #   connect ... アプリ接続できなかった
+  #   changeTime, changeRunMode ... 時刻・実行モードを設定できなかった
+  FINISHED_STATES = [:connected, :failed, :cancelled]
+
+  attr_accessor :transitionHandler, :completionHandler, :callbackQueue
+  attr_reader :state, :failure, :error
+
+  # camera は AppCamera、wifiConnector は probeCamera(timeout) {} に応えるもの、
+  # bluetoothConnector は BluetoothConnector です。(Wi-Fiだけで接続する場合はnilでも構いません)
+  def initialize(camera, wifiConnector, bluetoothConnector = nil)
+    @camera = camera
+    @wifiConnector = wifiConnector
+    @bluetoothConnector = bluetoothConnector
+    @transitionHandler = nil
+    @completionHandler = nil
+    # MARK: 進捗画面の更新はメインスレッドへ同期的に投げるので、既定ではメインキュー以外で呼び出します。
+    @callbackQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CameraConnectionStateMachine.callback")
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CameraConnectionStateMachine.queue")
+    @workQueue = Dispatch::Queue.concurrent("#{App::ENV['APP_IDENTIFIER']}.CameraConnectionStateMachine.work")
+    @state = :idle
+    @transitions = []
+    self
+  end
+
+  # 接続を始めます。すぐに戻ります。
+  # wakeUp が真なら、Bluetoothでの電源投入とWi-Fi接続の確認を同時に進めます。
+  # すでにカメラの電源が入っていてWi-Fiで応答すれば、電源投入は途中で打ち切ります。
+  def start(wakeUp, bluetoothLocalName:localName, bluetoothPasscode:passcode)
+    @queue.sync {
+      next unless @state == :idle
+      @startedAt = CACurrentMediaTime()
+      @wifiReady = false
+      @bluetoothPhase = nil
+      @bluetoothCancelled = false
+      @localName = localName
+      @passcode = passcode
+      if wakeUp
+        transition(:wakingUp, :start)
+        startWakingUp
+      else
+        transition(:joiningWifi, :start)
+      end
+      startProbing(wakeUp ? WAKEUP_TIMEOUT + WIFI_TIMEOUT : WIFI_TIMEOUT)
+    }
+  end
+
+  # 待っているところはすぐに打ち切ります。アプリ接続がもう始まっていたら、終わった後に切断します。
+  def cancel
+    @queue.sync {
+      next if FINISHED_STATES.include?(@state)
+      finish(:cancelled, :cancel, nil, nil)
+    }
+  end
+
+  # 状態遷移の履歴です。時刻(time)は単調増加の時刻、経過(elapsed)は開始からの秒数です。
+  def transitions
+    result = nil
+    @queue.sync {
+      result = @transitions.dup
+    }
+    result
+  end
+
+  # 開始からその状態に入るまでの秒数です。
+  def elapsedUntil(state)
+    transition = transitions.find { |t| t[:to] == state }
+    transition ? transition[:elapsed] : nil
+  end
+
+  private
+
+  # transition、finish、stopWaiting、handleは@queueの中で呼び出します。
+
+  def transition(to, event)
+    now = CACurrentMediaTime()
+    record = { from: @state, to: to, event: event, time: now, elapsed: now - @startedAt }
+    dp "#{record[:from]} -> #{record[:to]} (#{event}, #{'%.3f' % record[:elapsed]}s)"
+    @transitions << record
+    @state = to
+    handler = @transitionHandler
+    @callbackQueue.async { handler.call(record) } if handler
+  end
+
+  def finish(state, event, failure, error)
+    @failure = failure
+    @error = error
+    # 失敗した時は、並行して進めていたWi-Fiの確認とBluetoothの待ちも打ち切ります。
+    stopWaiting unless state == :connected
+    transition(state, event)
+    handler = @completionHandler
+    @callbackQueue.async { handler.call(state == :connected, failure, error) } if handler
+  end
+
+  # 状態に関係なく届くイベントを処理します。
+  def handle(event, error = nil, failure = nil)
+    if FINISHED_STATES.include?(@state)
+      # 中止した後にアプリ接続が終わっていたら、つないだままにしないで切断します。
+      disconnectCamera if @state == :cancelled && [:appConnected, :configured, :configureFailed].include?(event)
+      return
+    end
+    case event
+    when :wifiReady
+      @wifiReady = true
+      if @state == :joiningWifi
+        startConnecting(event)
+      elsif @state == :wakingUp && @bluetoothPhase != :wakeup
+        # 電源投入を待たずにカメラが応答したので、Bluetoothの処理は打ち切ります。
+        @bluetoothCancelled = true
+        @bluetoothConnector.cancelWaiting
+        startConnecting(event)
+      end
+    when :wifiTimedOut
+      if @state == :joiningWifi || @state == :wakingUp
+        finish(:failed, event, :wifi, error)
+      end
+    when :wokenUp
+      return unless @state == :wakingUp
+      @wifiReady ? startConnecting(event) : transition(:joiningWifi, event)
+    when :wakeupFailed
+      return unless @state == :wakingUp
+      # Wi-Fiで応答しているならカメラの電源は入っているので続けます。
+      @wifiReady ? startConnecting(event) : finish(:failed, event, failure, error)
+    when :appConnected
+      transition(:configuring, event)
+      startConfiguring
+    when :appConnectFailed
+      finish(:failed, event, :connect, error)
+    when :configured
+      finish(:connected, event, nil, nil)
+    when :configureFailed
+      finish(:failed, event, failure, error)
+    end
+  end
+
+  def stopWaiting
+    @bluetoothCancelled = true
+    @wifiConnector.cancelProbingCamera
+    @bluetoothConnector.cancelWaiting if @bluetoothConnector && @bluetoothPhase
+  end
+
+  def post(event, error = nil, failure = nil)
+    @queue.async { handle(event, error, failure) }
+  end
+
+  def startProbing(timeout)
+    @wifiConnector.probeCamera(timeout) do |responded, elapsed|
+      post(responded ? :wifiReady : :wifiTimedOut)
+    end
+  end
+
+  # Bluetoothでカメラを探して接続し、電源を入れます。
+  def startWakingUp
+    @bluetoothPhase = :discovering
+    @workQueue.async {
+      wakeUpWithBluetooth
+    }
+  end
+
+  def changeBluetoothPhase(phase)
+    cancelled = false
+    @queue.sync {
+      cancelled = @bluetoothCancelled
+      @bluetoothPhase = phase unless cancelled
+    }
+    !cancelled
+  end
+
+  # @workQueueで呼び出します。
+  def wakeUpWithBluetooth
+    connector = @bluetoothConnector
+    connector.services = OLYCamera.bluetoothServices
+    connector.localName = @localName
+    error = Pointer.new(:object)
+    return disconnectBluetooth unless changeBluetoothPhase(:discovering)
+    if connector.connectionStatus == 'BluetoothConnectionStatusNotFound'
+      unless connector.discoverPeripheral(error)
+        return post(:wakeupFailed, error[0], :discover)
+      end
+    end
+    return disconnectBluetooth unless changeBluetoothPhase(:connecting)
+    if connector.connectionStatus == 'BluetoothConnectionStatusNotConnected'
+      unless connector.connectPeripheral(error)
+        disconnectBluetooth
+        return post(:wakeupFailed, error[0], :bluetoothConnect)
+      end
+    end
+    return disconnectBluetooth unless changeBluetoothPhase(:wakeup)
+
+    # MARK: カメラがUSB経由で給電中だと、wekeupメソッドはタイムアウトエラーが時々発生してしまうようです。
+    @camera.bluetoothPeripheral = connector.peripheral
+    @camera.bluetoothPassword = @passcode
+    @camera.bluetoothPrepareForRecordingWhenPowerOn = true
+    wokenUp = @camera.wakeup(error)
+    unless wokenUp
+      theError = error[0]
+      if theError && theError.domain == OLYCameraErrorDomain && theError.code == OLYCameraErrorOperationAborted
+        # MARK: カメラをUSB給電中に電源入れるとその後にWi-Fi接続できるようになるのにもかかわらずエラーが返ってくるようです。
+        dp "エラーにすると使い勝手が悪いので、無視して続行します。"
+        wokenUp = true
+      end
+    end
+    @camera.bluetoothPeripheral = nil
+    @camera.bluetoothPassword = nil
+
+    # MARK: このタイミングで切断することによって、果たしてWi-FiとBluetoothの電波干渉を避けることができるか?
+    disconnectBluetooth
+    wokenUp ? post(:wokenUp) : post(:wakeupFailed, error[0], :wakeup)
+  end
+
+  def disconnectBluetooth
+    error = Pointer.new(:object)
+    unless @bluetoothConnector.disconnectPeripheral(error)
+      dp "カメラとのBluetooth接続解除に失敗しました。エラーを無視して続行します。"
+    end
+    @bluetoothConnector.peripheral = nil
+  end
+
+  def startConnecting(event)
+    transition(:connecting, event)
+    @workQueue.async {
+      error = Pointer.new(:object)
+      if @camera.connect(OLYCameraConnectionTypeWiFi, error:error)
+        post(:appConnected)
+      else
+        post(:appConnectFailed, error[0])
+      end
+    }
+  end
+
+  def startConfiguring
+    @workQueue.async {
+      error = Pointer.new(:object)
+      # スマホの現在時刻をカメラに設定します。
+      # MARK: 保守モードでは受け付けないのでこのタイミングしかありません。
+      # MARK: 実行モードがスタンドアロンモードのまま放置するとカメラの自動スリープが働いてしまうので、保守モードへ変更しておきます。
+      if !@camera.changeTime(Time.now, error:error)
+        post(:configureFailed, error[0], :changeTime)
+      elsif !@camera.changeRunMode(OLYCameraRunModeMaintenance, error:error)
+        post(:configureFailed, error[0], :changeRunMode)
+      else
+        post(:configured)
+      end
+    }
+  end
+
+  def disconnectCamera
+    @workQueue.async {
+      error = Pointer.new(:object)
+      unless @camera.disconnectWithPowerOff(false, error:error)
+        dp "中止した接続を切断できませんでした。error=#{error[0]}"
+      end
+    }
+  end
+
+end
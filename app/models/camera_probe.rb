@@ -0,0 +1,177 @@
+class CameraProbe
+
+  include DebugConcern
+
+  # カメラのIPアドレスです。
+  CAMERA_URL = 'http://192.168.0.10/'
+  # 1回の問い合わせを諦めるまでの秒数です。
+  REQUEST_TIMEOUT = 1.0
+  # 応答がなかった時に問い合わせ直すまでの間隔(秒)です。失敗するたびに倍にします。
+  INITIAL_BACKOFF = 0.05
+  MAX_BACKOFF = 0.8
+
+  attr_reader :baseURL, :attempts
+
+  # カメラのWi-Fiに繋がっていて、カメラが応答するかを調べます。
+  # 経路の確認(Reachability)とCGIコマンドの問い合わせを同時に始めて、
+  # 応答がなければ間隔を空けて問い合わせ直します。経路が変わったら待たずにすぐ問い合わせ直します。
+  def initialize(baseURL = CAMERA_URL)
+    @baseURL = baseURL
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CameraProbe.queue")
+    @generation = 0
+    @attempts = 0
+    @handlers = {}
+    @nextHandlerId = 0
+    configuration = NSURLSessionConfiguration.ephemeralSessionConfiguration
+    configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData
+    configuration.timeoutIntervalForRequest = REQUEST_TIMEOUT
+    configuration.HTTPAdditionalHeaders = { 'Accept' => 'text/xml', 'User-Agent' => 'OlympusCameraKit' }
+    @session = NSURLSession.sessionWithConfiguration(configuration)
+    self
+  end
+
+  # handler: ->(responded, elapsed) {} 応答があった時か、timeout秒が過ぎた時に一度だけ呼び出されます。
+  # 問い合わせ中に呼び出された時は、新しく問い合わせを始めずにその結果を一緒に待ちます。
+  def probe(timeout, &handler)
+    handlerId = nil
+    @queue.sync {
+      @nextHandlerId += 1
+      handlerId = @nextHandlerId
+      @handlers[handlerId] = { handler: handler, startedAt: CACurrentMediaTime() }
+      next if @handlers.size > 1
+      @generation += 1
+      generation = @generation
+      @attempts = 0
+      @backoff = INITIAL_BACKOFF
+      @task = nil
+      startReachability(generation)
+      sendRequest(generation)
+    }
+    @queue.after(timeout) {
+      timeOut(handlerId)
+    }
+  end
+
+  # 待っているものすべてに応答がなかったことを知らせて、問い合わせをやめます。
+  def cancel
+    @queue.sync {
+      finishProbe(@generation, false)
+    }
+  end
+
+  # 使い終わったら呼び出します。(WifiConnectorを解放する時など)
+  def invalidate
+    cancel
+    @session.invalidateAndCancel
+  end
+
+  # カメラへの経路が変わった時に呼び出されます。
+  def routeChanged(generation)
+    @queue.async {
+      next if generation != @generation || @handlers.empty?
+      dp "カメラへの経路が変わったので、すぐに問い合わせ直します。"
+      @backoff = INITIAL_BACKOFF
+      # MARK: 経路ができる前に送った問い合わせは、タイムアウトするまで返ってこないことがあります。
+      # 送ったばかりの問い合わせはそのまま待ちます。
+      next if @task && CACurrentMediaTime() - @taskStartedAt < INITIAL_BACKOFF * 2
+      sendRequest(generation)
+    }
+  end
+
+  private
+
+  # 以下、@queueの中で呼び出します。
+
+  def sendRequest(generation)
+    return if generation != @generation || @handlers.empty?
+    @task.cancel if @task
+    @attempts += 1
+    attempt = @attempts
+    task = @session.dataTaskWithURL(NSURL.URLWithString(@baseURL + 'get_connectmode.cgi'), completionHandler:->(data, response, error) {
+      # 通信仕様書に沿った期待したレスポンスが返って来れば、このWi-Fiはカメラに接続していると判定します。
+      responded = !error && response.is_a?(NSHTTPURLResponse) && response.statusCode == 200 && data &&
+        NSString.alloc.initWithData(data, encoding:NSUTF8StringEncoding).to_s.include?('<connectmode>OPC</connectmode>')
+      @queue.async {
+        # 経路が変わって問い合わせ直した後に、古い問い合わせの結果が届くことがあります。
+        next if generation != @generation || attempt != @attempts
+        @task = nil
+        if responded
+          finishProbe(generation, true)
+        else
+          scheduleRetry(generation, attempt)
+        end
+      }
+    })
+    @task = task
+    @taskStartedAt = CACurrentMediaTime()
+    task.resume
+  end
+
+  def scheduleRetry(generation, attempt)
+    delay = @backoff
+    @backoff = [@backoff * 2, MAX_BACKOFF].min
+    @queue.after(delay) {
+      # 待っている間に経路の変化で問い合わせ直していたら何もしません。
+      sendRequest(generation) if attempt == @attempts
+    }
+  end
+
+  def finishProbe(generation, responded)
+    return if generation != @generation || @handlers.empty?
+    handlers = @handlers.values
+    @handlers = {}
+    stopProbe
+    now = CACurrentMediaTime()
+    dp "responded=#{responded}, attempts=#{@attempts}, handlers=#{handlers.size}"
+    handlers.each { |entry| callHandler(entry, responded, now) }
+  end
+
+  # 1つの待ち時間が過ぎたら、そのhandlerにだけ知らせます。誰も待っていなければ問い合わせをやめます。
+  def timeOut(handlerId)
+    entry = @handlers.delete(handlerId)
+    return unless entry
+    stopProbe if @handlers.empty?
+    now = CACurrentMediaTime()
+    dp "responded=false, attempts=#{@attempts}, elapsed=#{now - entry[:startedAt]}"
+    callHandler(entry, false, now)
+  end
+
+  def stopProbe
+    # 古い問い合わせの結果や再試行は、世代が変わったので無視されます。
+    @generation += 1
+    @task.cancel if @task
+    @task = nil
+    stopReachability
+  end
+
+  def callHandler(entry, responded, now)
+    handler = entry[:handler]
+    elapsed = now - entry[:startedAt]
+    Dispatch::Queue.concurrent.async {
+      handler.call(responded, elapsed)
+    }
+  end
+
+  def startReachability(generation)
+    reachability = Reachability.reachabilityWithHostName(NSURL.URLWithString(@baseURL).host)
+    weakSelf = WeakRef.new(self)
+    reachability.reachableBlock = ->(r) {
+      weakSelf.routeChanged(generation)
+    }
+    @reachability = reachability
+    # MARK: メインスレッドで呼び出さないとコールバックが呼び出されないようです。
+    Dispatch::Queue.main.async {
+      reachability.startNotifier
+    }
+  end
+
+  def stopReachability
+    reachability = @reachability
+    @reachability = nil
+    return unless reachability
+    Dispatch::Queue.main.async {
+      reachability.stopNotifier
+    }
+  end
+
+end
@@ -0,0 +1,237 @@
+class CameraPropertyCache
+
+  include DebugConcern
+
+  # 自分が書き込んだ後に届く変更の知らせを、その反映かもしれないとみなす時間(秒)です。(統計に使います)
+  ECHO_WINDOW = 2.0
+
+  # カメラプロパティの値を手元に持っておき、読み出しのたびにカメラへ問い合わせずに済ませます。
+  # 値は「<NAME/VALUE>」の文字列を一度だけ解析して、名前と値をそれぞれ番号(ID)に置き換えて保持します。
+  # カメラ側で値が変わった知らせ(camera:didChangeCameraProperty:)を受けたら、その名前だけを古いものとして扱い、
+  # 次に読み出す時に古いものをまとめて1回で問い合わせ直します。
+
+  @@internQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CameraPropertyCache.intern")
+  @@nameIds = {}
+  @@names = []
+  @@valueIds = {}
+  @@values = []
+
+  # プロパティ名の番号を返します。初めての名前なら番号を割り当てます。
+  def self.internName(name)
+    id = nil
+    @@internQueue.sync {
+      id = @@nameIds[name]
+      unless id
+        id = @@names.size
+        @@names << name
+        @@nameIds[name] = id
+      end
+    }
+    id
+  end
+
+  # 「<NAME/VALUE>」の文字列の番号を返します。
+  def self.internValue(value)
+    id = nil
+    @@internQueue.sync {
+      id = @@valueIds[value]
+      unless id
+        id = @@values.size
+        @@values << value
+        @@valueIds[value] = id
+      end
+    }
+    id
+  end
+
+  def self.nameOf(id)
+    @@names[id]
+  end
+
+  def self.valueOf(id)
+    @@values[id]
+  end
+
+  # 「<NAME/VALUE>」をプロパティ名の番号と値の番号に分けます。形式が違う場合はnilです。
+  def self.parse(value)
+    return nil unless value && value =~ /\A<([^\/>]+)\/[^>]*>\z/
+    [internName($1), internValue(value)]
+  end
+
+  # camera は cameraPropertyValues:error: と setCameraPropertyValues:error: と canSetCameraProperty: に応えるものです。
+  def initialize(camera)
+    @camera = camera
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CameraPropertyCache.queue")
+    # 名前の番号を添字にして値の番号を入れます。
+    @values = []
+    @stale = {}
+    # 自分が書き込んだ値の番号と時刻です。直後に届く変更の知らせが、その反映かどうかを確かめるのに使います。
+    @echoes = {}
+    # 書き込んだ直後に知らせが届いて、次に読み直した時に確かめる値の番号です。
+    @pendingEchoes = {}
+    resetStatistics
+    self
+  end
+
+  # 手元の値をすべて捨てます。(カメラとの接続が切れた時など)
+  def clear
+    @queue.sync {
+      @values = []
+      @stale = {}
+      @echoes = {}
+      @pendingEchoes = {}
+    }
+  end
+
+  # プロパティの値(「<NAME/VALUE>」)を返します。
+  # 手元にない時や古くなっている時は、古くなっている他のプロパティと一緒に問い合わせ直します。
+  def valueForName(name)
+    valuesForNames([name])[name]
+  end
+
+  def valuesForNames(names)
+    ids = names.map { |name| CameraPropertyCache.internName(name) }
+    missing = []
+    @queue.sync {
+      @reads += names.size
+      ids.each_with_index do |id, i|
+        missing << names[i] if !@values[id] || @stale[id]
+      end
+      @readHits += names.size - missing.size
+      # 問い合わせるついでに、他に古くなっているものも読み直します。
+      missing |= @stale.keys.map { |id| CameraPropertyCache.nameOf(id) } unless missing.empty?
+    }
+    fetch(missing) unless missing.empty?
+    result = {}
+    @queue.sync {
+      ids.each_with_index do |id, i|
+        result[names[i]] = @values[id] ? CameraPropertyCache.valueOf(@values[id]) : nil
+      end
+    }
+    result
+  end
+
+  # 値を書き込みます。手元の値と同じものは送らず、違うものだけを1回でまとめて送ります。
+  # 全部送れなかった場合は1つずつ送り直します。(設定できないプロパティが混ざっていることがあるので)
+  def setValues(values, error:error)
+    changed = {}
+    @queue.sync {
+      @writesRequested += values.size
+      values.each do |name, value|
+        id = CameraPropertyCache.internName(name)
+        valueId = CameraPropertyCache.internValue(value)
+        changed[name] = value if @values[id] != valueId || @stale[id]
+      end
+      @writesSkipped += values.size - changed.size
+      @roundTripsSaved += 1 if changed.empty?
+    }
+    return true if changed.empty?
+
+    countRoundTrip
+    if @camera.setCameraPropertyValues(changed, error:error)
+      changed.each { |name, value| store(name, value, true) }
+      @queue.sync { @writesSent += changed.size }
+      return true
+    end
+    dp "まとめて書き込めなかったので1つずつ書き込みます。error=#{error && error[0] ? error[0].localizedDescription : nil}"
+    succeeded = true
+    changed.each do |name, value|
+      countRoundTrip
+      if @camera.setCameraPropertyValues({ name => value }, error:error)
+        store(name, value, true)
+        @queue.sync { @writesSent += 1 }
+      else
+        succeeded = false
+      end
+    end
+    succeeded
+  end
+
+  # 自分で書き込んだ値を手元に反映します。(lockAutoExposureのようにプロパティを変える操作の後など)
+  def store(name, value, echo = false)
+    parsed = CameraPropertyCache.parse(value)
+    return unless parsed
+    @queue.sync {
+      @values[parsed[0]] = parsed[1]
+      @stale.delete(parsed[0])
+      expected = @pendingEchoes.delete(parsed[0])
+      @echoesConfirmed += 1 if !echo && expected == parsed[1]
+      @echoes[parsed[0]] = [parsed[1], CACurrentMediaTime()] if echo
+    }
+  end
+
+  # カメラ側でプロパティの値が変わった時に呼び出します。
+  # 自分の書き込みの反映でも、知らせには値が入っていないので古いものとして扱い、次に読む時に他の古いものとまとめて読み直します。
+  # MARK: カメラキットのデリゲートの中から呼び出されるので、ここではカメラに問い合わせません。
+  def invalidate(name)
+    id = CameraPropertyCache.internName(name)
+    @queue.sync {
+      @stale[id] = true
+      echo = @echoes.delete(id)
+      # 書き込んだ直後の知らせは、読み直した値が書き込んだ値のままなら反映だったと数えます。
+      @pendingEchoes[id] = echo[0] if echo && CACurrentMediaTime() - echo[1] < ECHO_WINDOW
+    }
+  end
+
+  # 今の設定で書き込めるプロパティの値だけを残します。(撮影モードによって読み出し専用になるプロパティがあるので)
+  def settableValues(values)
+    values.select { |name, value| @camera.canSetCameraProperty(name) }
+  end
+
+  # 指定したプロパティの今の値を辞書にします。
+  def snapshot(names)
+    valuesForNames(names).reject { |name, value| value.nil? }
+  end
+
+  def resetStatistics
+    @queue.sync {
+      @roundTrips = 0
+      @roundTripsSaved = 0
+      @reads = 0
+      @readHits = 0
+      @writesRequested = 0
+      @writesSent = 0
+      @writesSkipped = 0
+      @echoesConfirmed = 0
+    }
+  end
+
+  # 問い合わせの回数と、手元の値で済ませて省けた回数です。
+  # (読み出しは1件ごとに1回の問い合わせ、書き込みは1回の呼び出しごとに1回と数えます)
+  def statistics
+    result = nil
+    @queue.sync {
+      result = {
+        roundTrips: @roundTrips,
+        roundTripsSaved: @roundTripsSaved + @readHits,
+        reads: @reads,
+        readHits: @readHits,
+        writesRequested: @writesRequested,
+        writesSent: @writesSent,
+        writesSkipped: @writesSkipped,
+        echoesConfirmed: @echoesConfirmed,
+        cached: @values.compact.size,
+        stale: @stale.size
+      }
+    }
+    result
+  end
+
+  private
+
+  def fetch(names)
+    return if names.empty?
+    countRoundTrip
+    values = @camera.cameraPropertyValues(NSSet.setWithArray(names), error:nil)
+    unless values
+      dp "カメラプロパティを読み出せませんでした。names=#{names}"
+      return
+    end
+    values.each { |name, value| store(name, value) }
+  end
+
+  def countRoundTrip
+    @queue.sync { @roundTrips += 1 }
+  end
+
+end
@@ -0,0 +1,322 @@
+class CaptureScheduler
+
+  include DebugConcern
+
+  # 露出補正のカメラプロパティです。ブラケットはこの値をずらして撮ります。
+  EXPOSURE_PROPERTY = 'EXPREV'
+  # 露出補正の範囲です。(1/3段単位)
+  MAX_EXPOSURE_THIRDS = 15
+  # 1枚の撮影を待つ時間の上限(秒)です。
+  SHOT_TIMEOUT = 30.0
+  # 撮影計画の最初の1枚を撮り始めるまでの余裕(秒)です。
+  START_DELAY = 0.05
+  # 撮り終えた後に、まだ届いていないプレビュー画像を待つ時間(秒)です。過ぎたら届かないものとして諦めます。
+  PREVIEW_GRACE = 2.0
+
+  attr_accessor :imageHandler
+
+  # インターバルタイマーとオートブラケットの撮影計画を作ります。
+  # countは撮影する回数、intervalはその間隔(秒)、bracketは1回ごとに撮る露出補正のずらし幅(1/3段単位)の並びです。
+  # optionsは1枚ごとのtakePictureにそのまま渡します。
+  def self.plan(count, interval, bracket = [0], options = nil)
+    {
+      count: [count.to_i, 1].max,
+      interval: [interval.to_f, 0.0].max,
+      bracket: bracket.empty? ? [0] : bracket,
+      options: options
+    }
+  end
+
+  # 枚数とずらし幅(1/3段単位)から、0・マイナス・プラスの順に並べたブラケットを作ります。
+  def self.bracketOf(count, step)
+    (0...[count.to_i, 1].max).map { |i| (i + 1) / 2 * step * (i.odd? ? -1 : 1) }
+  end
+
+  # 1/3段単位の値を露出補正のプロパティ値にします。(-1 => '<EXPREV/-0.3>', 4 => '<EXPREV/+1.3>')
+  def self.exposureValueOf(thirds)
+    thirds = [[thirds, -MAX_EXPOSURE_THIRDS].max, MAX_EXPOSURE_THIRDS].min
+    return "<#{EXPOSURE_PROPERTY}/0.0>" if thirds == 0
+    whole = thirds.abs / 3
+    fraction = ['0', '3', '7'][thirds.abs % 3]
+    "<#{EXPOSURE_PROPERTY}/#{thirds < 0 ? '-' : '+'}#{whole}.#{fraction}>"
+  end
+
+  def self.thirdsOf(value)
+    matched = value.to_s.match(/<#{EXPOSURE_PROPERTY}\/([+-]?)(\d+)\.(\d)>/)
+    return 0 unless matched
+    thirds = matched[2].to_i * 3 + { '0' => 0, '3' => 1, '7' => 2 }[matched[3]].to_i
+    matched[1] == '-' ? -thirds : thirds
+  end
+
+  # 撮影計画に従って、決まった時刻にシャッターを切ります。
+  # 時刻は最初の1回からの経過時間(t0 + k * interval)で決めるので、撮影に時間がかかっても後ろにずれていきません。
+  # プレビュー画像の受信と保存は別キューで行い、その間に次の撮影を始めます。
+  def initialize(camera)
+    @camera = camera
+    @lockQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CaptureScheduler.lock")
+    @timerQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CaptureScheduler.timer")
+    @shotQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CaptureScheduler.shot")
+    @transferQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.CaptureScheduler.transfer")
+    @running = false
+    @generation = 0
+    @planGeneration = nil
+    @pendingShots = []
+    resetStatistics
+    self
+  end
+
+  def running
+    @running
+  end
+
+  # 撮影計画を始めます。progressHandlerは1枚撮るたびに、completionHandlerは最後の1枚を撮り終えた時に
+  # 撮影用のキューから呼び出されます。
+  def start(plan, progressHandler:progressHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+    generation = nil
+    @lockQueue.sync {
+      next if @running
+      @running = true
+      @generation += 1
+      generation = @generation
+      # MARK: 前の撮影計画のプレビュー画像がまだ届くことがあるので、受信を待っている撮影は消さずに残します。
+      @planGeneration = generation
+      @plan = plan
+      @progressHandler = progressHandler
+      @completionHandler = completionHandler
+      @errorHandler = errorHandler
+      resetStatisticsLocked
+    }
+    return false unless generation
+
+    # 撮影後確認画像(RECVIEW)がOFFの時はプレビュー画像が届かないので、受信を待つ撮影を並べません。
+    @expectsPreviews = @camera.propertyCache.valueForName('RECVIEW') != '<RECVIEW/OFF>'
+    # ブラケットの基準は今の露出補正です。手元の値で足りるのでカメラには問い合わせません。
+    bracketing = plan[:bracket].uniq.size > 1 || plan[:bracket][0] != 0
+    baseValue = bracketing ? @camera.propertyCache.valueForName(EXPOSURE_PROPERTY) : nil
+    baseThirds = CaptureScheduler.thirdsOf(baseValue)
+    @exposures = plan[:bracket].map { |offset| bracketing ? CaptureScheduler.exposureValueOf(baseThirds + offset) : nil }
+    @baseExposure = baseValue
+    dp "count=#{plan[:count]}, interval=#{plan[:interval]}, exposures=#{@exposures.compact}"
+    @startTime = CACurrentMediaTime() + START_DELAY
+    scheduleTick(0, generation)
+    true
+  end
+
+  # 撮影中の1枚を撮り終えたところで止めます。
+  def stop
+    generation = nil
+    @lockQueue.sync {
+      next unless @running
+      @running = false
+      generation = @generation
+    }
+    @shotQueue.async { finish(generation) } if generation
+  end
+
+  # カメラキットがプレビュー画像を受信した時に呼び出します。(カメラキットのスレッドから呼び出されます)
+  # 撮影の順番に受信するので、撮影した順に対応付けます。
+  # 前の撮影計画の撮影がまだ残っていたら、その撮影のものとして読み捨てます。(今の撮影計画の画像とずれないように)
+  def receiveCapturedImage(data, metadata)
+    receivedAt = CACurrentMediaTime()
+    shot = nil
+    stale = false
+    @lockQueue.sync {
+      shot = @pendingShots.shift
+      stale = shot && shot[:generation] != @planGeneration
+    }
+    return false unless shot
+    if stale
+      dp "前の撮影計画のプレビュー画像なので保存しません。tick=#{shot[:tick]}"
+      return false
+    end
+    @transferQueue.async {
+      @imageHandler.call(data, metadata, shot) if @imageHandler
+      savedAt = CACurrentMediaTime()
+      @lockQueue.sync {
+        @transfers << { shot: shot, receivedAt: receivedAt, savedAt: savedAt }
+      }
+    }
+    true
+  end
+
+  # 受信を待っている撮影があれば諦めます。(届くはずのプレビュー画像が届かなかった時など)
+  # generationを指定すると、その撮影計画の撮影だけを諦めます。
+  def discardPendingShots(generation = nil)
+    discarded = 0
+    @lockQueue.sync {
+      remaining = generation ? @pendingShots.reject { |shot| shot[:generation] == generation } : []
+      discarded = @pendingShots.size - remaining.size
+      @pendingShots = remaining
+    }
+    dp "プレビュー画像が届かなかった#{discarded}枚を諦めます。" if discarded > 0
+  end
+
+  # 撮った分の受信と保存が終わるまで待ちます。(テスト用)
+  def waitUntilTransferred(timeout)
+    deadline = CACurrentMediaTime() + timeout
+    while CACurrentMediaTime() < deadline
+      done = false
+      @lockQueue.sync {
+        done = !@running && @pendingShots.empty?
+      }
+      if done
+        # 止めた後の後始末と、保存中の画像を待ちます。
+        @shotQueue.sync {}
+        @transferQueue.sync {}
+        return true
+      end
+      sleep(0.005)
+    end
+    false
+  end
+
+  def resetStatistics
+    @lockQueue.sync {
+      resetStatisticsLocked
+    }
+  end
+
+  # 予定時刻からの遅れ(lateness)と、撮影の間隔の予定とのずれ(jitter)を秒で返します。
+  # shotsPerMinuteは最初の撮影から最後の撮影までの、持続した撮影速度です。
+  def statistics
+    result = nil
+    @lockQueue.sync {
+      lateness = @ticks.map { |tick| tick[:triggeredAt] - tick[:scheduledAt] }
+      interval = @plan ? @plan[:interval] : 0.0
+      # 飛ばした回があっても、予定の間隔の何回分かと比べます。
+      jitter = @ticks.each_cons(2).map { |a, b| (b[:triggeredAt] - a[:triggeredAt]) - (b[:index] - a[:index]) * interval }
+      elapsed = @shots.size < 2 ? 0.0 : @shots.last[:triggeredAt] - @shots.first[:triggeredAt]
+      transferTimes = @transfers.map { |transfer| transfer[:savedAt] - transfer[:shot][:capturedAt] }
+      result = {
+        shots: @shots.size,
+        ticks: @ticks.size,
+        skippedTicks: @skippedTicks,
+        failedShots: @failedShots,
+        transfers: @transfers.size,
+        latenessMean: mean(lateness.map(&:abs)),
+        latenessMax: lateness.map(&:abs).max || 0.0,
+        drift: lateness.last || 0.0,
+        jitterRms: Math.sqrt(mean(jitter.map { |value| value * value })),
+        jitterMax: jitter.map(&:abs).max || 0.0,
+        shotsPerMinute: elapsed > 0 ? (@shots.size - 1) * 60.0 / elapsed : 0.0,
+        transferTimeMax: transferTimes.max || 0.0,
+        exposures: @shots.map { |shot| shot[:exposure] }
+      }
+    }
+    result
+  end
+
+  private
+
+  def resetStatisticsLocked
+    @ticks = []
+    @shots = []
+    @transfers = []
+    @skippedTicks = 0
+    @failedShots = 0
+  end
+
+  # k回目の予定時刻にタイマーを掛けます。遅れは次の予定に持ち越しません。
+  def scheduleTick(k, generation)
+    return if k >= @plan[:count]
+    scheduledAt = @startTime + k * @plan[:interval]
+    delay = [scheduledAt - CACurrentMediaTime(), 0.0].max
+    @timerQueue.after(delay) {
+      next unless current?(generation)
+      # 撮影が終わるのを待たずに次の予定を立てます。
+      scheduleTick(k + 1, generation)
+      @shotQueue.async { shootTick(k, scheduledAt, generation) }
+    }
+  end
+
+  def shootTick(k, scheduledAt, generation)
+    return unless current?(generation)
+    triggeredAt = CACurrentMediaTime()
+    last = (k == @plan[:count] - 1)
+    # 前の撮影が長引いて次の予定時刻も過ぎていたら、この回は飛ばして予定の方に合わせます。
+    if @plan[:interval] > 0 && triggeredAt - scheduledAt >= @plan[:interval] && !last
+      dp "#{k}回目は予定より#{((triggeredAt - scheduledAt) * 1000).round}ms遅れたので飛ばします。"
+      @lockQueue.sync { @skippedTicks += 1 }
+      return
+    end
+    @lockQueue.sync {
+      @ticks << { index: k, scheduledAt: scheduledAt, triggeredAt: triggeredAt }
+    }
+    @exposures.each_with_index do |exposure, i|
+      break unless current?(generation)
+      shootOne({ generation: generation, tick: k, index: i, exposure: exposure, scheduledAt: scheduledAt })
+    end
+    finish(generation) if last
+  end
+
+  def shootOne(shot)
+    error = Pointer.new(:object)
+    if shot[:exposure] && !@camera.propertyCache.setValues({ EXPOSURE_PROPERTY => shot[:exposure] }, error:error)
+      dp "露出補正を変えられませんでした。error=#{error[0]}"
+    end
+    # 受信したプレビュー画像と順番で対応付けられるように、シャッターを切る前に並べておきます。
+    @lockQueue.sync { @pendingShots << shot } if @expectsPreviews
+    shot[:triggeredAt] = CACurrentMediaTime()
+    semaphore = Dispatch::Semaphore.new(0)
+    failure = nil
+    @camera.takePicture(@plan[:options], progressHandler:nil, completionHandler:->(info) {
+      semaphore.signal
+    }, errorHandler:->(takeError) {
+      failure = takeError || true
+      semaphore.signal
+    })
+    failure ||= :timeout unless semaphore.wait(SHOT_TIMEOUT)
+    shot[:capturedAt] = CACurrentMediaTime()
+    @lockQueue.sync {
+      if failure
+        @failedShots += 1
+        @pendingShots.delete(shot)
+      else
+        @shots << shot
+      end
+    }
+    if failure
+      dp "撮影できませんでした。error=#{failure}"
+      @errorHandler.call(failure) if @errorHandler
+    else
+      @progressHandler.call(shot) if @progressHandler
+    end
+  end
+
+  def finish(generation)
+    completionHandler = nil
+    finished = false
+    @lockQueue.sync {
+      next unless generation == @generation
+      @running = false
+      @generation += 1
+      finished = true
+      completionHandler = @completionHandler
+    }
+    # しばらく待っても届かないプレビュー画像は、この撮影計画の分だけ諦めます。
+    if finished
+      @timerQueue.after(PREVIEW_GRACE) {
+        discardPendingShots(generation)
+      }
+    end
+    # ブラケットでずらした露出補正を元に戻します。
+    if @baseExposure
+      error = Pointer.new(:object)
+      @camera.propertyCache.setValues({ EXPOSURE_PROPERTY => @baseExposure }, error:error)
+    end
+    completionHandler.call(statistics) if completionHandler
+  end
+
+  def current?(generation)
+    result = false
+    @lockQueue.sync {
+      result = @running && generation == @generation
+    }
+    result
+  end
+
+  def mean(values)
+    values.empty? ? 0.0 : values.inject(0.0) { |sum, value| sum + value } / values.size
+  end
+
+end
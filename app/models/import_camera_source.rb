@@ -0,0 +1,29 @@
+class ImportCameraSource
+
+  include DebugConcern
+
+  def initialize(camera = AppCamera.instance)
+    @camera = camera
+    self
+  end
+
+  # downloadLargeContentで分割して受信します。
+  # MARK: カメラキットには途中から受信する手段がないので、再開時も先頭から受信して、すでに書き終えた分を読み捨てます。
+  # ディスクへの書き込みとハッシュの計算は続きからになります。
+  def fetchContent(content, offset:offset, chunkHandler:chunkHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+    path = "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+    received = 0
+    @camera.downloadLargeContent(path, progressHandler:->(data, progress, stop) {
+      chunkStart = received
+      received += data.length
+      next if received <= offset
+      chunk = chunkStart >= offset ? data : data.subdataWithRange(NSMakeRange(offset - chunkStart, received - offset))
+      stop[0] = true unless chunkHandler.call(chunk)
+    }, completionHandler:-> {
+      completionHandler.call
+    }, errorHandler:->(error) {
+      errorHandler.call(error)
+    })
+  end
+
+end
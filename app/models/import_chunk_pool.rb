@@ -0,0 +1,39 @@
+class ImportChunkPool
+
+  include DebugConcern
+
+  attr_reader :count, :capacity
+
+  # 取り込み中に確保するメモリはこのプールのバッファだけにします。
+  # 空きがない時は、書き込みが追いつくまで受信側を待たせます。
+  def initialize(count, capacity)
+    @count = count
+    @capacity = capacity
+    @buffers = (0...count).map { NSMutableData.dataWithCapacity(capacity) }
+    @available = Dispatch::Semaphore.new(count)
+    @lock = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportChunkPool.lock")
+    self
+  end
+
+  def checkout
+    @available.wait
+    buffer = nil
+    @lock.sync {
+      buffer = @buffers.pop
+    }
+    buffer.setLength(0)
+    buffer
+  end
+
+  def checkin(buffer)
+    @lock.sync {
+      @buffers.push(buffer)
+    }
+    @available.signal
+  end
+
+  def bytesReserved
+    @count * @capacity
+  end
+
+end
@@ -0,0 +1,308 @@
+class ImportEngine
+
+  include DebugConcern
+
+  # 受信したデータはこの大きさのバッファにまとめてからディスクに書き出します。
+  CHUNK_CAPACITY = 512 * 1024
+  # 使い回すバッファの数です。受信・書き込み・ハッシュ計算が重なっても足りる程度にします。
+  CHUNK_BUFFERS = 4
+  # Wi-Fiが切れた時に続きから再開を試みる回数と、その間隔(秒)です。
+  MAX_RETRIES = 5
+  RETRY_INTERVAL = 1.0
+  # 写真ライブラリに保存できる拡張子です。(RAWは取り込みフォルダに残します)
+  LIBRARY_EXTENSIONS = %w(JPG JPEG)
+  # 写真ライブラリへの保存を待つ時間の上限(秒)です。
+  SAVE_TIMEOUT = 10.0
+
+  attr_accessor :saveToLibrary, :progressHandler, :completionHandler
+  attr_reader :directory
+
+  def self.defaultDirectory
+    documents = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, true)[0]
+    documents.stringByAppendingPathComponent('Import')
+  end
+
+  # source は fetchContent(content, offset:offset, chunkHandler:, completionHandler:, errorHandler:) に応えるものです。
+  # (ImportCameraSourceかImportHttpSource)
+  def initialize(source, directory = ImportEngine.defaultDirectory)
+    @source = source
+    @directory = directory
+    @saveToLibrary = true
+    @progressHandler = nil
+    @completionHandler = nil
+    NSFileManager.defaultManager.createDirectoryAtPath(@directory, withIntermediateDirectories:true, attributes:nil, error:nil)
+    @journal = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+    @pool = ImportChunkPool.new(CHUNK_BUFFERS, CHUNK_CAPACITY)
+    # 受信、書き込み(とハッシュ計算)、写真ライブラリへの保存をそれぞれ別のキューで重ねて進めます。
+    @downloadQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportEngine.download")
+    @writeQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportEngine.write")
+    @saveQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportEngine.save")
+    @statisticsQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportEngine.statistics")
+    @assetsLibrary = ALAssetsLibrary.alloc.init
+    @cancelled = false
+    @retryWait = Dispatch::Semaphore.new(0)
+    resetStatistics
+    self
+  end
+
+  # コンテンツ一覧の要素を順に取り込みます。すぐに戻ります。
+  def import(contents)
+    @cancelled = false
+    @retryWait = Dispatch::Semaphore.new(0)
+    resetStatistics
+    group = Dispatch::Group.new
+    weakSelf = WeakRef.new(self)
+    @downloadQueue.async {
+      contents.each do |content|
+        break if weakSelf.cancelled
+        next unless weakSelf.downloadContent(content)
+        # 保存している間に次のファイルの受信を始めます。
+        group.enter
+        @saveQueue.async {
+          weakSelf.saveContent(content)
+          group.leave
+        }
+      end
+      group.notify(Dispatch::Queue.main) {
+        weakSelf.finishStatistics
+        weakSelf.completionHandler.call(weakSelf.statistics) if weakSelf.completionHandler
+      }
+    }
+  end
+
+  def cancel
+    @cancelled = true
+    @retryWait.signal
+  end
+
+  def cancelled
+    @cancelled
+  end
+
+  def statistics
+    result = nil
+    @statisticsQueue.sync {
+      elapsed = (@finishedAt || CACurrentMediaTime()) - @startedAt
+      result = {
+        files: @files,
+        failedFiles: @failedFiles,
+        bytesWritten: @bytesWritten,
+        bytesReceived: @bytesReceived,
+        resumes: @resumes,
+        elapsed: elapsed,
+        megabytesPerSecond: elapsed > 0 ? @bytesWritten / elapsed / (1024 * 1024) : 0.0,
+        peakResidentBytes: @peakResidentBytes,
+        bufferBytes: @pool.bytesReserved
+      }
+    }
+    result
+  end
+
+  # 1ファイルを受信しきるまで戻りません。(@downloadQueueで呼び出します)
+  # 写真ライブラリへの保存に進むならtrueを返します。
+  def downloadContent(content)
+    path = contentPath(content)
+    size = content[OLYCameraContentListFilesizeKey].to_i
+    entry = @journal.entryFor(path, size:size)
+    localPath = localPathFor(content)
+    fileManager = NSFileManager.defaultManager
+    case entry['state']
+    when 'saved'
+      # 前回保存まで済んでいます。(受信したファイルは保存した時に消しています)
+      return false
+    when 'downloaded'
+      # 前回受信し終えて保存する前に中断したので、保存だけやり直します。
+      return true if fileManager.fileExistsAtPath(localPath)
+      dp "受信したファイルがなくなっているので、最初から受信し直します。path=#{path}"
+      entry = @journal.restartEntry(path)
+    end
+
+    # 記録より短いファイルの続きに書くと、足りない分が0で埋まってしまうので最初から受信し直します。
+    offset = entry['bytes']
+    if offset > 0 && fileLengthAt(localPath) < offset
+      dp "途中まで受信したファイルが記録より短いので、最初から受信し直します。path=#{path}"
+      entry = @journal.restartEntry(path)
+      offset = 0
+    end
+    fileManager.createFileAtPath(localPath, contents:nil, attributes:nil) unless fileManager.fileExistsAtPath(localPath)
+    fileHandle = NSFileHandle.fileHandleForWritingAtPath(localPath)
+    unless fileHandle
+      countFailure(path, "CouldNotOpenFile")
+      return false
+    end
+    # 記録より先まで書かれていても、記録を信じてそこで切り詰めます。
+    fileHandle.truncateFileAtOffset(offset)
+    hasher = ImportHasher.new
+    if offset > 0 && !hasher.updateWithFile(localPath, offset)
+      dp "途中まで受信したファイルを読み直せなかったので、最初から受信し直します。path=#{path}"
+      entry = @journal.restartEntry(path)
+      offset = 0
+      fileHandle.truncateFileAtOffset(offset)
+      hasher = ImportHasher.new
+    end
+
+    retries = 0
+    loop do
+      @statisticsQueue.sync { @resumes += 1 } if offset > 0 && offset < size
+      error = fetchContent(content, offset, fileHandle, hasher)
+      @writeQueue.sync {}
+      offset = @journal.entryFor(path, size:size)['bytes']
+      break unless error
+      retries += 1
+      if @cancelled || retries > MAX_RETRIES
+        fileHandle.closeFile
+        countFailure(path, error.localizedDescription)
+        return false
+      end
+      dp "受信が中断したので#{offset}バイト目から再開します。error=#{error.localizedDescription}"
+      # MARK: Wi-Fiの再接続を待ちます。キャンセルされたらすぐに抜けられるようにセマフォで待ちます。
+      @retryWait.wait(RETRY_INTERVAL * retries)
+    end
+    fileHandle.synchronizeFile
+    fileHandle.closeFile
+    if offset != size
+      countFailure(path, "SizeMismatch #{offset}/#{size}")
+      return false
+    end
+    @journal.markDownloaded(path, sha256:hasher.hexdigest)
+    @statisticsQueue.sync { @files += 1 }
+    true
+  end
+
+  # 受信したファイルを写真ライブラリに保存します。(@saveQueueで呼び出します)
+  def saveContent(content)
+    path = contentPath(content)
+    extension = content[OLYCameraContentListFilenameKey].pathExtension.uppercaseString
+    if @saveToLibrary && LIBRARY_EXTENSIONS.include?(extension)
+      data = NSData.dataWithContentsOfFile(localPathFor(content), options:NSDataReadingMappedIfSafe, error:nil)
+      unless data
+        countFailure(path, "CouldNotReadFile")
+        return
+      end
+      sema = Dispatch::Semaphore.new(0)
+      saved = false
+      @assetsLibrary.writeImageDataToSavedPhotosAlbum(data, metadata:nil, completionBlock:->(assetURL, error) {
+        dp "写真ライブラリに保存できませんでした。path=#{path}, error=#{error}" if error
+        saved = !error
+        sema.signal
+      })
+      # MARK: 保存が終わった知らせが来ないと、次のファイルの保存に進めなくなるので待つ時間を区切ります。
+      unless sema.wait(SAVE_TIMEOUT)
+        countFailure(path, "SaveTimedOut")
+        return
+      end
+      unless saved
+        countFailure(path, "CouldNotSaveToLibrary")
+        return
+      end
+      NSFileManager.defaultManager.removeItemAtPath(localPathFor(content), error:nil)
+    end
+    @journal.markSaved(path)
+    @progressHandler.call(content, statistics) if @progressHandler
+  end
+
+  def finishStatistics
+    @statisticsQueue.sync {
+      @finishedAt = CACurrentMediaTime()
+    }
+  end
+
+  # このプロセスが使っている物理メモリの量です。(vendor/ImportSupportのCのコードで求めます)
+  def self.residentMemoryBytes
+    bytes = ImportResidentMemoryBytes()
+    bytes > 0 ? bytes : nil
+  end
+
+  private
+
+  # 受信したチャンクをプールのバッファに詰めて、満杯になったら書き込みキューに渡します。
+  # 受信が終わるか中断するまで待って、中断した場合はそのエラーを返します。
+  def fetchContent(content, offset, fileHandle, hasher)
+    path = contentPath(content)
+    sema = Dispatch::Semaphore.new(0)
+    failure = nil
+    buffer = @pool.checkout
+    writeOffset = offset
+    flush = -> {
+      filled = buffer
+      fileOffset = writeOffset
+      writeOffset += filled.length
+      @writeQueue.async {
+        writeBuffer(filled, fileOffset, path, fileHandle, hasher)
+      }
+    }
+    @source.fetchContent(content, offset:offset, chunkHandler:->(chunk) {
+      @statisticsQueue.sync { @bytesReceived += chunk.length }
+      position = 0
+      while position < chunk.length
+        length = [CHUNK_CAPACITY - buffer.length, chunk.length - position].min
+        buffer.appendBytes(chunk.bytes + position, length:length)
+        position += length
+        if buffer.length >= CHUNK_CAPACITY
+          flush.call
+          # 書き込みが追いついていなければ、ここで空きバッファを待ちます。
+          buffer = @pool.checkout
+        end
+      end
+      !@cancelled
+    }, completionHandler:-> {
+      flush.call
+      sema.signal
+    }, errorHandler:->(error) {
+      # 受信できたところまでは書き出して、続きから再開できるようにします。
+      flush.call
+      failure = error
+      sema.signal
+    })
+    sema.wait
+    failure
+  end
+
+  def writeBuffer(buffer, fileOffset, path, fileHandle, hasher)
+    if buffer.length > 0
+      fileHandle.seekToFileOffset(fileOffset)
+      fileHandle.writeData(buffer)
+      hasher.update(buffer)
+      @journal.updateBytes(fileOffset + buffer.length, forPath:path)
+    end
+    resident = ImportEngine.residentMemoryBytes
+    @statisticsQueue.sync {
+      @bytesWritten += buffer.length
+      @peakResidentBytes = resident if resident && resident > @peakResidentBytes
+    }
+    @pool.checkin(buffer)
+  end
+
+  def countFailure(path, reason)
+    dp "取り込めませんでした。path=#{path}, reason=#{reason}"
+    @statisticsQueue.sync { @failedFiles += 1 }
+  end
+
+  def resetStatistics
+    @statisticsQueue.sync {
+      @startedAt = CACurrentMediaTime()
+      @finishedAt = nil
+      @files = 0
+      @failedFiles = 0
+      @bytesWritten = 0
+      @bytesReceived = 0
+      @resumes = 0
+      @peakResidentBytes = 0
+    }
+  end
+
+  # ディスク上のファイルの大きさです。ファイルがなければ0です。
+  def fileLengthAt(localPath)
+    attributes = NSFileManager.defaultManager.attributesOfItemAtPath(localPath, error:nil)
+    attributes ? attributes[NSFileSize].to_i : 0
+  end
+
+  def contentPath(content)
+    "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+  end
+
+  def localPathFor(content)
+    @directory.stringByAppendingPathComponent(content[OLYCameraContentListFilenameKey])
+  end
+
+end
@@ -0,0 +1,32 @@
+class ImportHasher
+
+  # SHA-256のダイジェストのバイト数です。(vendor/ImportSupportと合わせます)
+  DIGEST_LENGTH = 32
+
+  # 計算はvendor/ImportSupportのCのコードがCommonCryptoで行います。
+  # 計算途中の状態はこのオブジェクトが持つ領域に置くので、解放を気にする必要はありません。
+  def initialize
+    @context = Pointer.new(:uchar, ImportHashContextSize())
+    ImportHashInit(@context)
+    self
+  end
+
+  def update(data)
+    ImportHashUpdate(@context, data.bytes, data.length) if data.length > 0
+  end
+
+  # 途中まで取り込んであるファイルを読み直して、続きから計算できるようにします。
+  def updateWithFile(path, length)
+    data = NSData.dataWithContentsOfFile(path, options:NSDataReadingMappedIfSafe, error:nil)
+    return false unless data && data.length >= length
+    update(data.subdataWithRange(NSMakeRange(0, length)))
+    true
+  end
+
+  def hexdigest
+    digest = Pointer.new(:uchar, DIGEST_LENGTH)
+    ImportHashFinal(@context, digest)
+    (0...DIGEST_LENGTH).map { |i| '%02x' % digest[i] }.join
+  end
+
+end
@@ -0,0 +1,86 @@
+class ImportHttpSource
+
+  include DebugConcern
+
+  # カメラのHTTPサーバーから元画像をRange指定で受信します。
+  # カメラキットを通さないので、tools/camera_stand_in.rb を相手にテストできます。
+  def initialize(baseURL)
+    @baseURL = baseURL
+    @tasks = {}
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportHttpSource.queue")
+    configuration = NSURLSessionConfiguration.ephemeralSessionConfiguration
+    configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData
+    configuration.timeoutIntervalForRequest = 10.0
+    configuration.HTTPAdditionalHeaders = { 'User-Agent' => 'OlympusCameraKit' }
+    # MARK: 受信のコールバックは1本のキューに並べます。チャンクの順序が入れ替わらないように。
+    delegateQueue = NSOperationQueue.new
+    delegateQueue.maxConcurrentOperationCount = 1
+    @session = NSURLSession.sessionWithConfiguration(configuration, delegate:self, delegateQueue:delegateQueue)
+    self
+  end
+
+  def fetchContent(content, offset:offset, chunkHandler:chunkHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+    path = "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+    request = NSMutableURLRequest.requestWithURL(NSURL.URLWithString(@baseURL + path[1..-1]))
+    request.setValue("bytes=#{offset}-", forHTTPHeaderField:'Range') if offset > 0
+    task = @session.dataTaskWithRequest(request)
+    @queue.sync {
+      @tasks[task.taskIdentifier] = { offset: offset, skip: 0, chunkHandler: chunkHandler, completionHandler: completionHandler, errorHandler: errorHandler }
+    }
+    task.resume
+  end
+
+  def URLSession(session, dataTask:dataTask, didReceiveResponse:response, completionHandler:completionHandler)
+    handlers = handlersFor(dataTask)
+    if handlers && response.statusCode == 200 && handlers[:offset] > 0
+      # Rangeを無視されたので、書き終えた分を読み捨てます。
+      handlers[:skip] = handlers[:offset]
+    elsif !handlers || ![200, 206].include?(response.statusCode)
+      completionHandler.call(NSURLSessionResponseCancel)
+      return
+    end
+    completionHandler.call(NSURLSessionResponseAllow)
+  end
+
+  def URLSession(session, dataTask:dataTask, didReceiveData:data)
+    handlers = handlersFor(dataTask)
+    return unless handlers
+    if handlers[:skip] > 0
+      if data.length <= handlers[:skip]
+        handlers[:skip] -= data.length
+        return
+      end
+      data = data.subdataWithRange(NSMakeRange(handlers[:skip], data.length - handlers[:skip]))
+      handlers[:skip] = 0
+    end
+    dataTask.cancel unless handlers[:chunkHandler].call(data)
+  end
+
+  def URLSession(session, task:task, didCompleteWithError:error)
+    handlers = nil
+    @queue.sync {
+      handlers = @tasks.delete(task.taskIdentifier)
+    }
+    return unless handlers
+    response = task.response
+    if error
+      handlers[:errorHandler].call(error)
+    elsif !response || ![200, 206].include?(response.statusCode)
+      userInfo = { NSLocalizedDescriptionKey => "UnexpectedStatusCode #{response ? response.statusCode : 'none'}" }
+      handlers[:errorHandler].call(NSError.errorWithDomain(NSURLErrorDomain, code:NSURLErrorBadServerResponse, userInfo:userInfo))
+    else
+      handlers[:completionHandler].call
+    end
+  end
+
+  private
+
+  def handlersFor(task)
+    handlers = nil
+    @queue.sync {
+      handlers = @tasks[task.taskIdentifier]
+    }
+    handlers
+  end
+
+end
@@ -0,0 +1,86 @@
+class ImportJournal
+
+  include DebugConcern
+
+  # 受信した分を書き出す間隔(秒)です。状態が変わった時はすぐに書き出します。
+  SAVE_INTERVAL = 1.0
+
+  # 取り込みの進み具合をファイルごとに記録しておき、Wi-Fiが切れても続きから再開できるようにします。
+  #   bytes  ... 先頭から連続してディスクに書き終えたバイト数
+  #   state  ... 'downloading', 'downloaded', 'saved'
+  #   sha256 ... 受信し終えたファイルのハッシュ
+  def initialize(path)
+    @path = path
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.ImportJournal.queue")
+    @lastSavedAt = 0
+    @entries = {}
+    data = NSData.dataWithContentsOfFile(@path)
+    if data
+      entries = NSPropertyListSerialization.propertyListWithData(data, options:NSPropertyListMutableContainers, format:nil, error:nil)
+      @entries = entries if entries.is_a?(Hash)
+    end
+    self
+  end
+
+  # ファイルの大きさが変わっていたら(別のファイルになっていたら)最初からやり直します。
+  def entryFor(path, size:size)
+    entry = nil
+    @queue.sync {
+      entry = @entries[path]
+      if !entry || entry['size'] != size
+        entry = { 'size' => size, 'bytes' => 0, 'state' => 'downloading' }
+        @entries[path] = entry
+      end
+      entry = entry.dup
+    }
+    entry
+  end
+
+  # 受信し直すファイルの記録を最初に戻します。(途中まで受信したファイルがなくなっていた時など)
+  def restartEntry(path)
+    entry = nil
+    @queue.sync {
+      entry = @entries[path]
+      entry['bytes'] = 0
+      entry['state'] = 'downloading'
+      entry.delete('sha256')
+      entry = entry.dup
+    }
+    save(true)
+    entry
+  end
+
+  def updateBytes(bytes, forPath:path)
+    @queue.sync {
+      @entries[path]['bytes'] = bytes
+    }
+    save(false)
+  end
+
+  def markDownloaded(path, sha256:sha256)
+    @queue.sync {
+      @entries[path]['state'] = 'downloaded'
+      @entries[path]['sha256'] = sha256
+    }
+    save(true)
+  end
+
+  def markSaved(path)
+    @queue.sync {
+      @entries[path]['state'] = 'saved'
+    }
+    save(true)
+  end
+
+  def save(force)
+    data = nil
+    @queue.sync {
+      now = CACurrentMediaTime()
+      next if !force && now - @lastSavedAt < SAVE_INTERVAL
+      @lastSavedAt = now
+      data = NSPropertyListSerialization.dataWithPropertyList(@entries, format:NSPropertyListBinaryFormat_v1_0, options:0, error:nil)
+    }
+    data.writeToFile(@path, options:NSDataWritingAtomic, error:nil) if data
+  end
+
+end
@@ -0,0 +1,145 @@
+class LiveViewAnalyzer
+
+  include DebugConcern
+
+  # ヒストグラムの階調数とチャンネル(輝度・R・G・Bの順)です。(vendor/LiveViewAnalysisと合わせます)
+  HISTOGRAM_BINS = 256
+  HISTOGRAM_CHANNELS = [:luminance, :red, :green, :blue]
+
+  # フォーカスピーキングの閾値です。輝度のラプラシアン(|4C-L-R-U-D|)がこれ以上なら印を付けます。
+  PEAKING_THRESHOLD = 48
+  # ゼブラの閾値です。輝度がこれ以上なら白飛びしかけているとみなします。(約95%)
+  ZEBRA_THRESHOLD = 242
+
+  attr_accessor :histogramEnabled, :peakingEnabled, :zebraEnabled, :peakingThreshold, :zebraThreshold
+
+  # デコードしたライブビューの画像から、ヒストグラム・フォーカスピーキング・ゼブラを求めます。
+  # 計算はvendor/LiveViewAnalysisのCのコードが1回の走査でまとめて行います。
+  def initialize
+    @histogramEnabled = true
+    @peakingEnabled = true
+    @zebraEnabled = true
+    @peakingThreshold = PEAKING_THRESHOLD
+    @zebraThreshold = ZEBRA_THRESHOLD
+    @lockQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.LiveViewAnalyzer.lock")
+    # 作業領域はサイズごとに使い回します。ワーカーの数だけあれば足ります。
+    @workspaces = []
+    @phase = 0
+    dp "kernel=#{LVAKernelName()}"
+    self
+  end
+
+  # 別スレッドで呼び出されます。複数のワーカーから同時に呼び出されても構いません。
+  # 戻り値の画像は解析のために展開したもので、表示する時にJPEGを展開し直さずに済みます。
+  def analyze(image)
+    cgImage = image.CGImage
+    return nil unless cgImage
+    width = CGImageGetWidth(cgImage)
+    height = CGImageGetHeight(cgImage)
+    workspace = checkoutWorkspace(width, height)
+    return nil unless workspace
+    begin
+      bitmap = workspace[:bitmap]
+      CGContextDrawImage(bitmap, CGRectMake(0, 0, width, height), cgImage)
+      histogram = @histogramEnabled ? workspace[:histogram] : nil
+      peakingMask = @peakingEnabled ? NSMutableData.dataWithLength(width * height) : nil
+      zebraMask = @zebraEnabled ? NSMutableData.dataWithLength(width * height) : nil
+      startTime = CACurrentMediaTime()
+      peakingPixels = LVAAnalyze(workspace[:context],
+        CGBitmapContextGetData(bitmap).cast!('C'), CGBitmapContextGetBytesPerRow(bitmap),
+        histogram,
+        peakingMask ? peakingMask.mutableBytes.cast!('C') : nil,
+        zebraMask ? zebraMask.mutableBytes.cast!('C') : nil,
+        @peakingThreshold, @zebraThreshold, nextPhase)
+      duration = CACurrentMediaTime() - startTime
+      {
+        image: UIImage.imageWithCGImage(CGBitmapContextCreateImage(bitmap), scale:image.scale, orientation:image.imageOrientation),
+        orientation: image.imageOrientation,
+        width: width,
+        height: height,
+        histogram: histogram ? histogramOf(histogram) : nil,
+        peakingMask: peakingMask ? maskImageOf(peakingMask, width, height) : nil,
+        peakingPixels: peakingPixels,
+        zebraMask: zebraMask ? maskImageOf(zebraMask, width, height) : nil,
+        duration: duration
+      }
+    ensure
+      checkinWorkspace(workspace)
+    end
+  end
+
+  def kernelName
+    LVAKernelName()
+  end
+
+  # 作業領域をすべて解放します。(撮影画面を抜ける時など)
+  def purge
+    @lockQueue.sync {
+      @workspaces.each { |w| LVAContextRelease(w[:context]) }
+      @workspaces = []
+    }
+  end
+
+  private
+
+  def checkoutWorkspace(width, height)
+    workspace = nil
+    @lockQueue.sync {
+      index = @workspaces.index { |w| w[:width] == width && w[:height] == height }
+      workspace = @workspaces.delete_at(index) if index
+      # ライブビューのサイズが変わったら古いサイズの作業領域は捨てます。
+      stale = @workspaces.select { |w| w[:width] != width || w[:height] != height }
+      @workspaces -= stale
+      stale.each { |w| LVAContextRelease(w[:context]) }
+    }
+    workspace || createWorkspace(width, height)
+  end
+
+  def checkinWorkspace(workspace)
+    @lockQueue.sync {
+      @workspaces << workspace
+    }
+  end
+
+  def createWorkspace(width, height)
+    context = LVAContextCreate(width, height)
+    return nil unless context
+    # MARK: LiveViewAnalysisはR,G,B,Xの並びを前提にしています。
+    bitmap = CGBitmapContextCreate(nil, width, height, 8, width * 4, CGColorSpaceCreateDeviceRGB(), KCGImageAlphaNoneSkipLast | KCGBitmapByteOrder32Big)
+    CGContextSetInterpolationQuality(bitmap, KCGInterpolationNone)
+    dp "width=#{width}, height=#{height}"
+    {
+      width: width,
+      height: height,
+      context: context,
+      bitmap: bitmap,
+      histogram: Pointer.new('I', HISTOGRAM_BINS * HISTOGRAM_CHANNELS.size)
+    }
+  end
+
+  # ゼブラの縞をフレームごとに1ピクセルずつずらして、流れて見えるようにします。
+  def nextPhase
+    phase = nil
+    @lockQueue.sync {
+      @phase += 1
+      phase = @phase
+    }
+    phase
+  end
+
+  def histogramOf(pointer)
+    result = {}
+    HISTOGRAM_CHANNELS.each_with_index do |channel, c|
+      offset = c * HISTOGRAM_BINS
+      result[channel] = (0...HISTOGRAM_BINS).map { |i| pointer[offset + i] }
+    end
+    result
+  end
+
+  # 印を付けたピクセルだけが不透明なアルファのみの画像にします。レイヤーのマスクに使います。
+  def maskImageOf(data, width, height)
+    provider = CGDataProviderCreateWithCFData(data)
+    CGImageCreate(width, height, 8, 8, width, nil, KCGImageAlphaOnly, provider, nil, false, KCGRenderingIntentDefault)
+  end
+
+end
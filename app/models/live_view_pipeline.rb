@@ -0,0 +1,186 @@
+class LiveViewPipeline
+
+  include DebugConcern
+
+  # 同時にデコードするワーカーの数です。
+  # MARK: ライブビューは最新の1フレームだけに意味があるので、多くしても遅延が減るわけではありません。
+  DEFAULT_WORKERS = 2
+
+  # レイテンシ統計のために保持しておくフレーム数です。
+  LATENCY_SAMPLES = 300
+
+  attr_accessor :decoder, :analyzer, :presenter, :observer, :presentQueue
+  attr_reader :workers
+
+  # decoder:   ->(data, metadata) { image } 別スレッドで呼び出されます。
+  # analyzer:  LiveViewAnalyzer デコードと同じスレッドで続けて呼び出されます。(省略可)
+  # presenter: ->(image, metadata, analysis) {} presentQueue(省略時はメインキュー)で呼び出されます。
+  # observer:  ->(frame) {} 表示したフレームの時刻情報を受け取ります。(省略可)
+  def initialize(workers = DEFAULT_WORKERS, &presenter)
+    @workers = workers
+    @presenter = presenter
+    @decoder = ->(data, metadata) {
+      # metadataにはカメラ本体の回転情報が入っているが、3（天地逆）以外はすべて正対として扱う
+      OLYCameraConvertDataToImage(data, {"Orientation" => (metadata['Orientation'] == 3 ? 3 : 1)})
+    }
+    @analyzer = nil
+    @observer = nil
+    @presentQueue = Dispatch::Queue.main
+    @lockQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.LiveViewPipeline.lock")
+    @decodeQueue = Dispatch::Queue.concurrent("#{App::ENV['APP_IDENTIFIER']}.LiveViewPipeline.decode")
+    @running = true
+    resetStatistics
+    self
+  end
+
+  # カメラからライブビューのフレームを受け取ります。
+  # デリゲートを呼び出したスレッドはすぐに戻ります。
+  def receive(data, metadata)
+    frame = { data: data, metadata: metadata, receivedAt: now }
+    @lockQueue.sync {
+      next unless @running
+      @sequence += 1
+      frame[:sequence] = @sequence
+      @received += 1
+      # まだデコードされていないフレームは、新しいフレームで上書きします。(latest-wins)
+      @droppedBeforeDecode += 1 if @pendingFrame
+      @pendingFrame = frame
+    }
+    scheduleDecode
+  end
+
+  # 新しいフレームの受け付けを止めて、未処理のフレームを捨てます。
+  def stop
+    @lockQueue.sync {
+      @running = false
+      @droppedBeforeDecode += 1 if @pendingFrame
+      @pendingFrame = nil
+    }
+  end
+
+  def start
+    @lockQueue.sync {
+      @running = true
+    }
+  end
+
+  def resetStatistics
+    @lockQueue.sync {
+      @sequence = 0
+      @pendingFrame = nil
+      @busyWorkers = 0
+      @latestDecodedSequence = 0
+      @received = 0
+      @decoded = 0
+      @presented = 0
+      @droppedBeforeDecode = 0
+      @droppedAfterDecode = 0
+      @latencies = []
+    }
+  end
+
+  # 受信→デコード→表示の時間とフレーム落ちの数を集計します。
+  def statistics
+    result = nil
+    @lockQueue.sync {
+      latencies = @latencies.dup
+      result = {
+        received: @received,
+        decoded: @decoded,
+        presented: @presented,
+        droppedBeforeDecode: @droppedBeforeDecode,
+        droppedAfterDecode: @droppedAfterDecode,
+        receiveToDecode: summarize(latencies.map { |l| l[:receiveToDecode] }),
+        analyze: summarize(latencies.map { |l| l[:analyze] }.compact),
+        decodeToPresent: summarize(latencies.map { |l| l[:decodeToPresent] }),
+        receiveToPresent: summarize(latencies.map { |l| l[:receiveToPresent] })
+      }
+    }
+    result
+  end
+
+  def scheduleDecode
+    frame = nil
+    @lockQueue.sync {
+      next if !@pendingFrame || @busyWorkers >= @workers
+      frame = @pendingFrame
+      @pendingFrame = nil
+      @busyWorkers += 1
+    }
+    return unless frame
+    @decodeQueue.async {
+      decodeFrame(frame)
+    }
+  end
+
+  def decodeFrame(frame)
+    image = nil
+    begin
+      frame[:decodeStartedAt] = now
+      image = @decoder.call(frame[:data], frame[:metadata])
+      frame[:decodedAt] = now
+      analyzer = @analyzer
+      if image && analyzer
+        # 解析のために展開した画像をそのまま表示に使います。
+        frame[:analysis] = analyzer.analyze(image)
+        image = frame[:analysis][:image] if frame[:analysis]
+        frame[:analyzedAt] = now
+      end
+    rescue => e
+      dp "フレーム#{frame[:sequence]}をデコードできませんでした。error=#{e.message}"
+      image = nil
+    ensure
+      # デコードに失敗しても空きを戻さないと、ワーカーが尽きてデコードが止まってしまいます。
+      @lockQueue.sync {
+        @busyWorkers -= 1
+        @decoded += 1
+        if image && @running && frame[:sequence] > @latestDecodedSequence
+          @latestDecodedSequence = frame[:sequence]
+          # MARK: ロックの中で表示キューに積むことで、表示の順序がフレームの順序と逆転しないようにします。
+          @presentQueue.async {
+            presentFrame(frame, image)
+          }
+        else
+          # より新しいフレームが先にデコードを終えていたか、デコードできなかったので、このフレームは表示しません。
+          @droppedAfterDecode += 1
+        end
+      }
+      # デコード中に届いたフレームがあれば続けて処理します。
+      scheduleDecode
+    end
+  end
+
+  def presentFrame(frame, image)
+    @presenter.call(image, frame[:metadata], frame[:analysis]) if @presenter
+    frame[:presentedAt] = now
+    @lockQueue.sync {
+      @presented += 1
+      @latencies << {
+        receiveToDecode: frame[:decodedAt] - frame[:receivedAt],
+        analyze: frame[:analyzedAt] ? frame[:analyzedAt] - frame[:decodedAt] : nil,
+        decodeToPresent: frame[:presentedAt] - frame[:decodedAt],
+        receiveToPresent: frame[:presentedAt] - frame[:receivedAt]
+      }
+      @latencies.shift if @latencies.size > LATENCY_SAMPLES
+    }
+    @observer.call(frame) if @observer
+  end
+
+  private
+
+  def now
+    CACurrentMediaTime()
+  end
+
+  def summarize(values)
+    return { mean: 0.0, p50: 0.0, p95: 0.0, max: 0.0 } if values.empty?
+    sorted = values.sort
+    {
+      mean: sorted.inject(0.0) { |sum, v| sum + v } / sorted.size,
+      p50: sorted[[(sorted.size * 0.50).floor, sorted.size - 1].min],
+      p95: sorted[[(sorted.size * 0.95).floor, sorted.size - 1].min],
+      max: sorted.last
+    }
+  end
+
+end
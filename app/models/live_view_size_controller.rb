@@ -0,0 +1,228 @@
+class LiveViewSizeController
+
+  include DebugConcern
+
+  # 小さい順に並べたライブビューのサイズです。
+  SIZES = [
+    OLYCameraLiveViewSizeQVGA,   # 320×240
+    OLYCameraLiveViewSizeVGA,    # 640×480
+    OLYCameraLiveViewSizeSVGA,   # 800×600
+    OLYCameraLiveViewSizeXGA,    # 1024×768
+    OLYCameraLiveViewSizeQuadVGA # 1280×960
+  ]
+
+  # カメラが送ってくるライブビューの理想的なフレーム間隔です。
+  TARGET_FRAME_INTERVAL = 1.0 / 30
+  # 平滑化係数です。大きいほど最新のフレームを重視します。
+  SMOOTHING = 0.1
+  # サイズを切り替えた直後は計測値が安定しないので、このフレーム数だけ判定を保留します。
+  WARMUP_FRAMES = 10
+  # 下げる判定と上げる判定に必要な連続フレーム数です。(上げる方を慎重にします)
+  DOWN_FRAMES = 15
+  UP_FRAMES = 90
+  # 切り替えてから次に上げるまでの最短時間(秒)です。
+  MIN_DWELL = 5.0
+  # 輻輳で下げたサイズに再挑戦するまでの待ち時間(秒)です。失敗するたびに倍にします。
+  RETRY_BACKOFF = 10.0
+  MAX_RETRY_BACKOFF = 80.0
+
+  attr_reader :index, :floorIndex, :ceilingIndex, :frameInterval, :frameJitter, :decodeTime, :payloadSize, :switches
+
+  def initialize(sizes = SIZES, targetFrameInterval = TARGET_FRAME_INTERVAL)
+    @sizes = sizes
+    @targetFrameInterval = targetFrameInterval
+    @floorIndex = 0
+    @ceilingIndex = @sizes.size - 1
+    @index = 0
+    @magnifying = false
+    @sizeBeforeMagnifying = nil
+    @backoffUntil = {}
+    @backoff = {}
+    @switches = []
+    @proposal = nil
+    resetMeasurements
+    self
+  end
+
+  def currentSize
+    @sizes[@index]
+  end
+
+  # 計測をやり直してサイズを指定したものにします。(撮影モードに入った時など)
+  # 今と同じサイズでも、カメラに書き込むためにそのサイズを返します。
+  # MARK: 拡大ビューのまま撮影画面を抜けることがあるので、拡大ビューの下限もここで外します。
+  def reset(size)
+    @magnifying = false
+    @floorIndex = 0
+    @sizeBeforeMagnifying = nil
+    @backoffUntil = {}
+    @backoff = {}
+    @switches = []
+    @lastSwitchAt = nil
+    resetMeasurements
+    propose(clampIndex(indexOfSize(size)))
+  end
+
+  # 返したサイズをカメラに書き込めた時に呼び出します。ここで初めて今のサイズが変わります。
+  def commit(size)
+    proposal = takeProposal(size)
+    return false unless proposal
+    if proposal[:reason]
+      dp "ライブビューのサイズを変更します。#{@index} -> #{proposal[:index]} (#{proposal[:reason]})"
+      @switches << { time: proposal[:time], from: @index, to: proposal[:index], reason: proposal[:reason] }
+      @lastSwitchAt = proposal[:time]
+    end
+    # 輻輳したサイズには、しばらく戻らないようにします。
+    if proposal[:reason] == 'congested'
+      backoff = [(@backoff[@index] || RETRY_BACKOFF / 2) * 2, MAX_RETRY_BACKOFF].min
+      @backoff[@index] = backoff
+      @backoffUntil[@index] = proposal[:time] + backoff
+    elsif proposal[:reason] == 'healthy'
+      # 今のサイズは安定しているので、待ち時間を初期値に戻します。
+      @backoff.delete(@index)
+    end
+    @index = proposal[:index]
+    resetMeasurements
+    true
+  end
+
+  # 返したサイズをカメラに書き込めなかった時に呼び出します。今のサイズのまま計測をやり直します。
+  def reject(size)
+    return false unless takeProposal(size)
+    resetMeasurements
+    true
+  end
+
+  # 拡大ビューの間は指定の下限より小さいサイズにしません。
+  # 変更すべきサイズがある場合はそのサイズを返します。(書き込んだ結果をcommitかrejectで知らせます)
+  def startMagnifying(floor)
+    return nil if @magnifying
+    @magnifying = true
+    @sizeBeforeMagnifying = currentSize
+    @floorIndex = indexOfSize(floor)
+    proposeChange(clampIndex(@index))
+  end
+
+  # 拡大ビューを終えたら拡大前のサイズに戻します。
+  def stopMagnifying
+    return nil unless @magnifying
+    @magnifying = false
+    @floorIndex = 0
+    size = @sizeBeforeMagnifying
+    @sizeBeforeMagnifying = nil
+    proposeChange(clampIndex(indexOfSize(size)))
+  end
+
+  # ライブビューのフレームを受信した時刻とその大きさを記録します。
+  # サイズを変更すべきと判断した場合はそのサイズを返します。(書き込んだ結果をcommitかrejectで知らせます)
+  def observeArrival(time, bytes)
+    if @lastArrival
+      interval = time - @lastArrival
+      @arrivals += 1
+      if @arrivals > WARMUP_FRAMES
+        if @frameInterval
+          @frameJitter = smooth(@frameJitter, (interval - @frameInterval).abs)
+          @frameInterval = smooth(@frameInterval, interval)
+        else
+          @frameInterval = interval
+          @frameJitter = 0.0
+        end
+        @payloadSize = smooth(@payloadSize, bytes.to_f)
+      end
+    end
+    @lastArrival = time
+    return nil unless @frameInterval
+    evaluate(time)
+  end
+
+  # ライブビューのフレームをデコードするのに要した時間を記録します。
+  def observeDecode(duration)
+    @decodeTime = smooth(@decodeTime, duration)
+  end
+
+  def evaluate(time)
+    # 拡大ビューの下限まで上げられなかった時は、書き込めるまで上げ直します。
+    return propose(@floorIndex, time, 'floor') if @index < @floorIndex
+    if congested?
+      @upFrames = 0
+      @downFrames += 1
+      if @downFrames >= DOWN_FRAMES && @index > @floorIndex
+        return propose(@index - 1, time, 'congested')
+      end
+    elsif healthy?
+      @downFrames = 0
+      @upFrames += 1
+      if @upFrames >= UP_FRAMES && @index < @ceilingIndex &&
+          (!@lastSwitchAt || time - @lastSwitchAt >= MIN_DWELL) &&
+          (!@backoffUntil[@index + 1] || time >= @backoffUntil[@index + 1])
+        return propose(@index + 1, time, 'healthy')
+      end
+    else
+      @downFrames = 0
+      @upFrames = 0
+    end
+    nil
+  end
+
+  # フレーム間隔が目標より大きく遅れているか、デコードが間に合っていない。
+  def congested?
+    @frameInterval > @targetFrameInterval * 1.25 ||
+      (@decodeTime && @decodeTime > @frameInterval * 0.8)
+  end
+
+  # フレーム間隔が安定していて、ひとつ上のサイズでもデコードが間に合いそう。
+  def healthy?
+    return false if @frameInterval > @targetFrameInterval * 1.15
+    return false if @frameJitter > @targetFrameInterval * 0.3
+    return true if @index >= @sizes.size - 1 || !@decodeTime
+    @decodeTime * pixelRatio(@index + 1, @index) < @targetFrameInterval * 0.6
+  end
+
+  private
+
+  def proposeChange(index)
+    return nil if index == @index
+    propose(index)
+  end
+
+  # 変更するサイズを覚えておいて返します。カメラに書き込めるまで今のサイズは変えません。
+  def propose(index, time = nil, reason = nil)
+    @proposal = { index: index, time: time, reason: reason }
+    @sizes[index]
+  end
+
+  def takeProposal(size)
+    proposal = @proposal
+    return nil if !proposal || !size || indexOfSize(size) != proposal[:index]
+    @proposal = nil
+    proposal
+  end
+
+  def resetMeasurements
+    @lastArrival = nil
+    @arrivals = 0
+    @frameInterval = nil
+    @frameJitter = nil
+    @payloadSize = nil
+    @decodeTime = nil
+    @upFrames = 0
+    @downFrames = 0
+  end
+
+  def smooth(average, value)
+    average ? average + (value - average) * SMOOTHING : value
+  end
+
+  def pixelRatio(to, from)
+    (@sizes[to].width * @sizes[to].height) / (@sizes[from].width * @sizes[from].height).to_f
+  end
+
+  def indexOfSize(size)
+    @sizes.index { |s| s.width == size.width && s.height == size.height } || 0
+  end
+
+  def clampIndex(index)
+    [[index, @floorIndex].max, @ceilingIndex].min
+  end
+
+end
@@ -0,0 +1,288 @@
+class MagnifyController
+
+  include DebugConcern
+
+  # 表示範囲移動をこれより多く重ねるなら、拡大を止めて目標の位置で拡大し直します。(止めると拡大するの2回で済みます)
+  MAX_DIRECT_STEPS = 2
+  # 操作がひと段落した後にカメラに表示範囲を問い合わせる回数の上限です。これを越えたらカメラの位置に合わせます。
+  MAX_SYNC_ROUNDS = 3
+  # 要求が途切れてから表示範囲を問い合わせるまでの時間(秒)です。なぞっている間は問い合わせずに移動だけを送ります。
+  QUIET_PERIOD = 0.05
+  # 落ち着くまでの時間を覚えておく数です。
+  SETTLE_HISTORY = 100
+
+  attr_accessor :previewHandler
+
+  # 拡大ビューの移動と倍率変更の要求を受け付けて、カメラへのコマンドをできるだけ少なくまとめます。
+  # 要求は目標の状態(拡大しているか・中心・倍率)を書き換えるだけで、すぐに戻ります。
+  # コマンドは別キューで1つずつ送り、送るたびにその時の目標から次に送るものを決め直すので、
+  # カメラが応答を返すまでの間に溜まった要求は1つのコマンドにまとまります。
+  # 座標はビューファインダー座標系(ライブビュー全体を幅1.0・高さ1.0とする)です。
+  def initialize(camera)
+    @camera = camera
+    @lockQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.MagnifyController.lock")
+    @commandQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.MagnifyController.command")
+    @magnifying = false
+    @center = CGPointMake(0.5, 0.5)
+    @scale = OLYCameraMagnifyingLiveViewScaleX5
+    @cameraScale = nil
+    @running = false
+    @dirty = false
+    @syncRounds = 0
+    @requestedAt = nil
+    @lastRequestAt = nil
+    resetStatistics
+    self
+  end
+
+  # 拡大しようとしているかどうかです。(カメラがまだ追いついていなくても)
+  def magnifying
+    @magnifying
+  end
+
+  # カメラが実際に拡大しているかどうかです。
+  def cameraMagnifying
+    @camera.magnifyingLiveView
+  end
+
+  def scale
+    @scale
+  end
+
+  # 目指している表示範囲です。カメラが追いつくまでは、最後の全体のフレームをこの範囲で切り抜いて見せます。
+  def targetRect
+    rect = nil
+    @lockQueue.sync {
+      rect = @camera.magnifyingDisplayAreaRectAt(@center, @scale)
+    }
+    rect
+  end
+
+  def start(point, scale)
+    request {
+      @magnifying = true
+      @scale = scale
+      @center = clampCenter(point)
+    }
+  end
+
+  def stop
+    request {
+      @magnifying = false
+    }
+  end
+
+  # 表示範囲の中心を動かします。dx, dyはビューファインダー座標系での移動量です。
+  def scrollBy(dx, dy)
+    request {
+      next unless @magnifying
+      @center = clampCenter(CGPointMake(@center.x + dx, @center.y + dy))
+    }
+  end
+
+  def changeScale(scale)
+    request {
+      @scale = scale
+      @center = clampCenter(@center)
+    }
+  end
+
+  # カメラが目標に追いつくまで待ちます。(撮影画面を抜ける時とテスト用)
+  def waitUntilSettled(timeout)
+    deadline = CACurrentMediaTime() + timeout
+    while CACurrentMediaTime() < deadline
+      settled = false
+      @lockQueue.sync {
+        settled = !@running
+      }
+      return true if settled
+      sleep(0.002)
+    end
+    false
+  end
+
+  def resetStatistics
+    @lockQueue.sync {
+      @requests = 0
+      @commands = Hash.new(0)
+      @settleTimes = []
+    }
+  end
+
+  def statistics
+    result = nil
+    @lockQueue.sync {
+      commands = @commands.values.inject(0) { |sum, count| sum + count }
+      sorted = @settleTimes.sort
+      result = {
+        requests: @requests,
+        commands: commands,
+        commandsByType: @commands.dup,
+        coalesced: [@requests - commands, 0].max,
+        settleTime50: percentile(sorted, 0.5),
+        settleTime95: percentile(sorted, 0.95)
+      }
+    }
+    result
+  end
+
+  private
+
+  def request(&block)
+    kick = false
+    rect = nil
+    @lockQueue.sync {
+      block.call
+      @requests += 1
+      @lastRequestAt = CACurrentMediaTime()
+      @requestedAt ||= @lastRequestAt
+      @syncRounds = 0
+      rect = @magnifying ? @camera.magnifyingDisplayAreaRectAt(@center, @scale) : nil
+      unless @running
+        @running = true
+        kick = true
+      end
+    }
+    notifyPreview(rect, false)
+    @commandQueue.async { runCommands } if kick
+  end
+
+  def runCommands
+    loop do
+      command = nil
+      @lockQueue.sync {
+        command = nextCommand
+        unless command
+          @running = false
+          if @requestedAt
+            @settleTimes << CACurrentMediaTime() - @requestedAt
+            @settleTimes.shift while @settleTimes.size > SETTLE_HISTORY
+            @requestedAt = nil
+          end
+        end
+      }
+      break unless command
+      if command[0] == :wait
+        @commandQueue.after(command[1]) { runCommands }
+        return
+      end
+      execute(command)
+    end
+    notifyPreview(@camera.magnifyingLiveView ? @camera.magnifyingDisplayAreaRect : nil, true)
+  end
+
+  # 今の目標とカメラの状態から、次に送るコマンドを1つ決めます。何も送らなくてよければnilです。
+  def nextCommand
+    cameraMagnifying = @camera.magnifyingLiveView
+    unless @magnifying
+      return cameraMagnifying ? [:stop] : nil
+    end
+    return [:start, @center, @scale] unless cameraMagnifying
+    steps = stepsToTarget
+    distance = steps[0].abs + steps[1].abs
+    if @scale != @cameraScale
+      # 倍率を変えると表示範囲の大きさが変わるので、移動も必要なら拡大し直す方が早く済みます。
+      return distance > 0 ? [:restart, @center, @scale] : [:scale, @scale]
+    end
+    return [:restart, @center, @scale] if distance > MAX_DIRECT_STEPS
+    if distance > 0
+      # 遠い方の軸から1つずつ動かします。
+      if steps[0].abs >= steps[1].abs
+        return [:scroll, steps[0] < 0 ? OLYCameraMagnifyingLiveViewScrollDirectionLeft : OLYCameraMagnifyingLiveViewScrollDirectionRight]
+      else
+        return [:scroll, steps[1] < 0 ? OLYCameraMagnifyingLiveViewScrollDirectionUp : OLYCameraMagnifyingLiveViewScrollDirectionDown]
+      end
+    end
+    return nil unless @dirty
+    quiet = CACurrentMediaTime() - @lastRequestAt
+    quiet < QUIET_PERIOD ? [:wait, QUIET_PERIOD - quiet] : [:sync]
+  end
+
+  def execute(command)
+    error = Pointer.new(:object)
+    before = @camera.magnifyingDisplayAreaRect
+    result = case command[0]
+    when :start
+      @camera.startMagnifyingLiveViewAtPoint(command[1], scale:command[2], error:error)
+    when :restart
+      @camera.restartMagnifyingLiveViewAtPoint(command[1], scale:command[2], error:error)
+    when :stop
+      @camera.stopMagnifyingLiveView(error)
+    when :scale
+      @camera.changeMagnifyingLiveViewScale(command[1], error:error)
+    when :scroll
+      @camera.changeMagnifyingLiveViewArea(command[1], error:error)
+    when :sync
+      @camera.syncMagnifyingLiveViewArea(error)
+    end
+    @lockQueue.sync {
+      @commands[command[0]] += 1
+      unless result
+        dp "#{command[0]}に失敗しました。error=#{error[0]}"
+        # 同じコマンドを送り続けないように、目標をカメラの今の状態に合わせます。
+        @magnifying = @camera.magnifyingLiveView
+        @center = centerOf(@camera.magnifyingDisplayAreaRect) if @magnifying
+        @dirty = false
+        next
+      end
+      case command[0]
+      when :start, :restart, :scale
+        @cameraScale = command[-1]
+        @dirty = true
+      when :stop
+        @cameraScale = nil
+        @dirty = false
+      when :scroll
+        @dirty = true
+        after = @camera.magnifyingDisplayAreaRect
+        # 端で動かなかった時はそれ以上動かせないので、目標をそこで止めます。
+        if after.origin.x == before.origin.x && after.origin.y == before.origin.y
+          horizontal = [OLYCameraMagnifyingLiveViewScrollDirectionLeft, OLYCameraMagnifyingLiveViewScrollDirectionRight].include?(command[1])
+          @center = horizontal ? CGPointMake(CGRectGetMidX(after), @center.y) : CGPointMake(@center.x, CGRectGetMidY(after))
+        end
+      when :sync
+        @dirty = false
+        @syncRounds += 1
+        # 何度問い合わせても目標に届かない時は、カメラの位置で諦めます。
+        @center = centerOf(@camera.magnifyingDisplayAreaRect) if @syncRounds >= MAX_SYNC_ROUNDS
+      end
+    }
+  end
+
+  # 目標の中心まで、表示範囲移動を何回(横・縦)行えばよいかです。
+  def stepsToTarget
+    rect = @camera.magnifyingDisplayAreaRect
+    step = @camera.magnifyingScrollStep
+    stepWidth = rect.size.width * step.width
+    stepHeight = rect.size.height * step.height
+    return [0, 0] if stepWidth <= 0 || stepHeight <= 0
+    target = clampCenter(@center)
+    [
+      ((target.x - CGRectGetMidX(rect)) / stepWidth).round,
+      ((target.y - CGRectGetMidY(rect)) / stepHeight).round
+    ]
+  end
+
+  # 表示範囲がライブビューからはみ出さない中心にします。
+  def clampCenter(point)
+    centerOf(@camera.magnifyingDisplayAreaRectAt(point, @scale))
+  end
+
+  def centerOf(rect)
+    CGPointMake(CGRectGetMidX(rect), CGRectGetMidY(rect))
+  end
+
+  def notifyPreview(rect, settled)
+    handler = @previewHandler
+    return unless handler
+    Dispatch::Queue.main.async {
+      handler.call(rect, settled)
+    }
+  end
+
+  def percentile(sorted, ratio)
+    return nil if sorted.empty?
+    sorted[[(sorted.size * ratio).ceil - 1, 0].max]
+  end
+
+end
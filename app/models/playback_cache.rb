@@ -0,0 +1,197 @@
+class PlaybackCache
+
+  include DebugConcern
+
+  # キャッシュに使うディスク容量の上限です。
+  DEFAULT_BYTE_BUDGET = 64 * 1024 * 1024
+  # 索引ファイルを書き出すまでの猶予(秒)です。短時間の更新はまとめて書き出します。
+  SAVE_DELAY = 2.0
+  INDEX_FILENAME = 'index.plist'
+
+  attr_reader :byteBudget, :totalBytes, :directory
+
+  # Rubymotionではシングルトンモジュールが使えない
+  def self.instance
+    Dispatch.once { @@instance ||= alloc.initWithDirectory(defaultDirectory, byteBudget:DEFAULT_BYTE_BUDGET) }
+    @@instance
+  end
+
+  def self.defaultDirectory
+    caches = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, true)[0]
+    caches.stringByAppendingPathComponent('PlaybackCache')
+  end
+
+  # コンテンツ一覧の要素(辞書)からキャッシュのキーを作ります。
+  # ファイルの大きさと日時も含めるので、カメラ側で撮り直された同名のファイルは別物として扱います。
+  def self.keyForContent(content, kind:kind)
+    directory = content[OLYCameraContentListDirectoryKey]
+    filename = content[OLYCameraContentListFilenameKey]
+    filesize = content[OLYCameraContentListFilesizeKey]
+    datetime = content[OLYCameraContentListDatetimeKey]
+    "#{kind}:#{directory}/#{filename}:#{filesize}:#{datetime ? datetime.timeIntervalSince1970.to_i : 0}"
+  end
+
+  def initWithDirectory(directory, byteBudget:byteBudget)
+    if init
+      @directory = directory
+      @byteBudget = byteBudget
+      @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.PlaybackCache.queue")
+      @savePending = false
+      @hits = 0
+      @misses = 0
+      NSFileManager.defaultManager.createDirectoryAtPath(@directory, withIntermediateDirectories:true, attributes:nil, error:nil)
+      loadIndex
+    end
+    self
+  end
+
+  # キャッシュされたデータを返します。無い場合はnilです。
+  # MARK: データはメモリマップされたままなので、大量に読んでもメモリに展開されません。
+  def dataForContent(content, kind:kind)
+    key = PlaybackCache.keyForContent(content, kind:kind)
+    entry = nil
+    @queue.sync {
+      entry = @entries.delete(key)
+      if entry
+        # 最近使ったものとして末尾に付け直します。(LRU)
+        @entries[key] = entry
+        @hits += 1
+      else
+        @misses += 1
+      end
+    }
+    return nil unless entry
+    data = NSData.dataWithContentsOfFile(blobPath(entry['blob']), options:NSDataReadingMappedIfSafe, error:nil)
+    unless data
+      # 誰かにファイルを消されていたら索引からも消します。
+      @queue.sync {
+        removeEntry(key)
+      }
+      scheduleSave
+    end
+    data
+  end
+
+  def containsContent(content, kind:kind)
+    key = PlaybackCache.keyForContent(content, kind:kind)
+    found = false
+    @queue.sync {
+      found = @entries.has_key?(key)
+    }
+    found
+  end
+
+  def storeData(data, forContent:content, kind:kind)
+    return false unless data
+    key = PlaybackCache.keyForContent(content, kind:kind)
+    blob = blobNameForKey(key)
+    # 同じキーの古いデータを読んでいる途中かもしれないので、別名で書いてから@queueの中で置き換えます。
+    temporaryPath = blobPath("#{blob}.#{NSUUID.UUID.UUIDString}.tmp")
+    return false unless data.writeToFile(temporaryPath, options:0, error:nil)
+    stored = false
+    @queue.sync {
+      # 古い索引は捨てますが、同じファイル名なのでファイルは置き換えで済ませます。
+      forgetEntry(key)
+      fileManager = NSFileManager.defaultManager
+      fileManager.removeItemAtPath(blobPath(blob), error:nil)
+      stored = fileManager.moveItemAtPath(temporaryPath, toPath:blobPath(blob), error:nil)
+      next unless stored
+      @entries[key] = { 'blob' => blob, 'bytes' => data.length }
+      @totalBytes += data.length
+      evictOverBudget
+    }
+    NSFileManager.defaultManager.removeItemAtPath(temporaryPath, error:nil) unless stored
+    scheduleSave
+    stored
+  end
+
+  def removeAllData
+    @queue.sync {
+      @entries.keys.each { |key| removeEntry(key) }
+    }
+    saveIndex
+  end
+
+  def statistics
+    result = nil
+    @queue.sync {
+      result = { entries: @entries.size, totalBytes: @totalBytes, byteBudget: @byteBudget, hits: @hits, misses: @misses }
+    }
+    result
+  end
+
+  # 索引をすぐに書き出します。(アプリがバックグラウンドに入る時など)
+  def saveIndex
+    index = nil
+    @queue.sync {
+      @savePending = false
+      # Hashの並び順がそのままLRUの順序になります。
+      index = @entries.map { |key, entry| [key, entry['blob'], entry['bytes']] }
+    }
+    data = NSPropertyListSerialization.dataWithPropertyList(index, format:NSPropertyListBinaryFormat_v1_0, options:0, error:nil)
+    data.writeToFile(indexPath, options:NSDataWritingAtomic, error:nil) if data
+  end
+
+  private
+
+  def loadIndex
+    @entries = {}
+    @totalBytes = 0
+    data = NSData.dataWithContentsOfFile(indexPath, options:NSDataReadingMappedIfSafe, error:nil)
+    return unless data
+    index = NSPropertyListSerialization.propertyListWithData(data, options:NSPropertyListImmutable, format:nil, error:nil)
+    return unless index.is_a?(Array)
+    index.each do |key, blob, bytes|
+      @entries[key] = { 'blob' => blob, 'bytes' => bytes }
+      @totalBytes += bytes
+    end
+    dp "キャッシュの索引を読み込みました。entries=#{@entries.size}, totalBytes=#{@totalBytes}"
+  end
+
+  def scheduleSave
+    schedule = false
+    @queue.sync {
+      schedule = !@savePending
+      @savePending = true
+    }
+    return unless schedule
+    weakSelf = WeakRef.new(self)
+    Dispatch::Queue.concurrent.after(SAVE_DELAY) {
+      weakSelf.saveIndex
+    }
+  end
+
+  # 古いものから容量の上限に収まるまで捨てます。(@queueの中で呼び出します)
+  def evictOverBudget
+    while @totalBytes > @byteBudget && @entries.size > 1
+      key = @entries.keys.first
+      removeEntry(key)
+    end
+  end
+
+  def removeEntry(key)
+    entry = forgetEntry(key)
+    return unless entry
+    NSFileManager.defaultManager.removeItemAtPath(blobPath(entry['blob']), error:nil)
+  end
+
+  # 索引からだけ消します。ファイルは残します。
+  def forgetEntry(key)
+    entry = @entries.delete(key)
+    @totalBytes -= entry['bytes'] if entry
+    entry
+  end
+
+  def blobNameForKey(key)
+    key.gsub(/[^0-9A-Za-z.]/, '_')
+  end
+
+  def blobPath(blob)
+    @directory.stringByAppendingPathComponent(blob)
+  end
+
+  def indexPath
+    @directory.stringByAppendingPathComponent(INDEX_FILENAME)
+  end
+
+end
@@ -0,0 +1,38 @@
+class PlaybackCameraFetcher
+
+  include DebugConcern
+
+  def initialize(camera = AppCamera.instance)
+    @camera = camera
+    self
+  end
+
+  # カメラの再生モードでコンテンツ一覧を取得します。
+  def downloadContentList(&handler)
+    @camera.downloadContentList(->(list, error) {
+      dp "コンテンツ一覧を取得できませんでした。error=#{error}" if error
+      handler.call(list ? list.select { |content| content[OLYCameraContentListFiletypeKey] == 'file' } : nil)
+    })
+  end
+
+  def fetchContent(content, kind:kind, completionHandler:completionHandler)
+    path = "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+    errorHandler = ->(error) {
+      dp "path=#{path}, kind=#{kind}, error=#{error}"
+      completionHandler.call(nil)
+    }
+    case kind
+    when 'thumbnail'
+      @camera.downloadContentThumbnail(path, progressHandler:nil, completionHandler:->(data, metadata) {
+        completionHandler.call(data)
+      }, errorHandler:errorHandler)
+    when 'screennail'
+      @camera.downloadContentScreennail(path, progressHandler:nil, completionHandler:->(data) {
+        completionHandler.call(data)
+      }, errorHandler:errorHandler)
+    else
+      completionHandler.call(nil)
+    end
+  end
+
+end
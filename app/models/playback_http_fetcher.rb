@@ -0,0 +1,96 @@
+class PlaybackHttpFetcher
+
+  include DebugConcern
+
+  CGI_FOR_KIND = {
+    'thumbnail'  => 'get_thumbnail.cgi',
+    'screennail' => 'get_screennail.cgi'
+  }
+
+  # カメラのCGIに直接HTTPでアクセスします。
+  # カメラキットを通さないので、tools/camera_stand_in.rb を相手にテストできます。
+  def initialize(baseURL, concurrency = PlaybackPrefetcher::DEFAULT_CONCURRENCY)
+    @baseURL = baseURL
+    configuration = NSURLSessionConfiguration.ephemeralSessionConfiguration
+    configuration.HTTPMaximumConnectionsPerHost = concurrency
+    configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData
+    configuration.HTTPAdditionalHeaders = { 'User-Agent' => 'OlympusCameraKit' }
+    @session = NSURLSession.sessionWithConfiguration(configuration)
+    self
+  end
+
+  # get_imglist.cgi を /DCIM から辿って、カメラキットのdownloadContentListと同じ形の一覧を作ります。
+  def downloadContentList(&handler)
+    get("get_imglist.cgi?DIR=/DCIM") do |data|
+      directories = parseImageList(data).select { |content| content[OLYCameraContentListFiletypeKey] == 'directory' }
+      list = []
+      group = Dispatch::Group.new
+      lock = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.PlaybackHttpFetcher.list")
+      directories.each do |directory|
+        path = "#{directory[OLYCameraContentListDirectoryKey]}/#{directory[OLYCameraContentListFilenameKey]}"
+        group.enter
+        get("get_imglist.cgi?DIR=#{path}") do |data|
+          contents = parseImageList(data).select { |content| content[OLYCameraContentListFiletypeKey] == 'file' }
+          lock.sync { list.concat(contents) }
+          group.leave
+        end
+      end
+      group.notify(Dispatch::Queue.concurrent) {
+        handler.call(list.sort_by { |content| content[OLYCameraContentListFilenameKey] })
+      }
+    end
+  end
+
+  def fetchContent(content, kind:kind, completionHandler:completionHandler)
+    cgi = CGI_FOR_KIND[kind]
+    return completionHandler.call(nil) unless cgi
+    path = "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+    get("#{cgi}?DIR=#{path}") do |data|
+      completionHandler.call(data)
+    end
+  end
+
+  private
+
+  def get(query, &block)
+    url = NSURL.URLWithString(@baseURL + query)
+    task = @session.dataTaskWithURL(url, completionHandler:->(data, response, error) {
+      if error || !response.is_a?(NSHTTPURLResponse) || response.statusCode != 200
+        dp "url=#{url}, error=#{error}"
+        block.call(nil)
+      else
+        block.call(data)
+      end
+    })
+    task.resume
+  end
+
+  # 一覧は「ディレクトリ,ファイル名,サイズ,属性,日付,時刻」の行が並んだテキストです。
+  # 日付と時刻はFATのタイムスタンプ形式になっています。
+  def parseImageList(data)
+    return [] unless data
+    text = NSString.alloc.initWithData(data, encoding:NSUTF8StringEncoding)
+    return [] unless text
+    text.split(/\r?\n/).drop(1).map { |line|
+      directory, filename, size, attributes, date, time = line.split(',')
+      next nil unless time
+      attributes = attributes.to_i
+      components = NSDateComponents.new
+      components.year = (date.to_i >> 9) + 1980
+      components.month = (date.to_i >> 5) & 0x0f
+      components.day = date.to_i & 0x1f
+      components.hour = time.to_i >> 11
+      components.minute = (time.to_i >> 5) & 0x3f
+      components.second = (time.to_i & 0x1f) * 2
+      {
+        OLYCameraContentListDirectoryKey => directory,
+        OLYCameraContentListFilenameKey => filename,
+        OLYCameraContentListFilesizeKey => size.to_i,
+        OLYCameraContentListFiletypeKey => (attributes & 0x10 != 0) ? 'directory' : 'file',
+        OLYCameraContentListAttributesKey => [],
+        OLYCameraContentListDatetimeKey => NSCalendar.currentCalendar.dateFromComponents(components)
+      }
+    }.compact
+  end
+
+end
@@ -0,0 +1,109 @@
+class PlaybackPrefetcher
+
+  include DebugConcern
+
+  # カメラへの同時リクエスト数です。
+  # MARK: カメラのWi-Fiは遅いうえに、同時に多く投げても速くはならないようです。
+  DEFAULT_CONCURRENCY = 2
+  # 表示範囲の先を何件まで先読みするかです。
+  DEFAULT_LOOKAHEAD = 40
+  # 表示範囲の手前(スクロールで戻る側)を何件まで先読みするかです。
+  DEFAULT_LOOKBEHIND = 10
+
+  attr_accessor :lookahead, :lookbehind, :fetchedHandler
+  attr_reader :concurrency
+
+  # fetcher は fetchContent(content, kind:kind, completionHandler:->(data) {}) に応えるものです。
+  # (PlaybackCameraFetcherかPlaybackHttpFetcher)
+  def initialize(cache, fetcher, concurrency = DEFAULT_CONCURRENCY)
+    @cache = cache
+    @fetcher = fetcher
+    @concurrency = concurrency
+    @lookahead = DEFAULT_LOOKAHEAD
+    @lookbehind = DEFAULT_LOOKBEHIND
+    @fetchedHandler = nil
+    @queue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.PlaybackPrefetcher.queue")
+    @pending = []
+    @inFlight = {}
+    @fetched = 0
+    @failed = 0
+    self
+  end
+
+  # 表示範囲が変わった時に呼び出します。
+  # 見えているもの、先のもの、手前のものの順に、キャッシュにないものだけを取りに行きます。
+  # 以前の表示範囲で積んだ未着手の取得は捨てます。
+  def prefetch(contents, visibleRange:range, kind:kind)
+    first = [range.begin, 0].max
+    last = [range.end - (range.exclude_end? ? 1 : 0), contents.size - 1].min
+    order = (first..last).to_a
+    order += ((last + 1)..[last + @lookahead, contents.size - 1].min).to_a
+    order += ([first - @lookbehind, 0].max...first).to_a.reverse
+    wanted = order.map { |index| contents[index] }.reject { |content| @cache.containsContent(content, kind:kind) }
+    @queue.sync {
+      @pending = wanted.map { |content| [content, kind] }
+    }
+    pump
+  end
+
+  def cancel
+    @queue.sync {
+      @pending = []
+    }
+  end
+
+  # まだ取得中か、取得待ちのものがあるか。
+  def busy
+    result = false
+    @queue.sync {
+      result = !@pending.empty? || !@inFlight.empty?
+    }
+    result
+  end
+
+  def statistics
+    result = nil
+    @queue.sync {
+      result = { pending: @pending.size, inFlight: @inFlight.size, fetched: @fetched, failed: @failed }
+    }
+    result
+  end
+
+  private
+
+  # 同時リクエスト数の枠が空いている分だけ取得を始めます。
+  def pump
+    started = []
+    @queue.sync {
+      while @inFlight.size < @concurrency && !@pending.empty?
+        content, kind = @pending.shift
+        key = PlaybackCache.keyForContent(content, kind:kind)
+        next if @inFlight[key]
+        @inFlight[key] = true
+        started << [key, content, kind]
+      end
+    }
+    started.each do |key, content, kind|
+      if @cache.containsContent(content, kind:kind)
+        finish(key, content, kind, nil, true)
+        next
+      end
+      @fetcher.fetchContent(content, kind:kind, completionHandler:->(data) {
+        @cache.storeData(data, forContent:content, kind:kind) if data
+        finish(key, content, kind, data, false)
+      })
+    end
+  end
+
+  def finish(key, content, kind, data, cached)
+    @queue.sync {
+      @inFlight.delete(key)
+      unless cached
+        data ? @fetched += 1 : @failed += 1
+      end
+    }
+    @fetchedHandler.call(content, kind, data) if @fetchedHandler && data
+    pump
+  end
+
+end
@@ -0,0 +1,79 @@
+class TraceRingBuffer
+
+  # 決まった数の記録だけを保持するリングバッファです。一杯になったら古いものから上書きします。
+  # 書き込む側はアトミックな加算で枠を取るだけなので、複数のスレッドから同時に書き込んでもロックで待ちません。
+  # 1件は「時刻、長さ、整数の付帯情報、オブジェクトの参照」で、文字列への整形は読み出す時に行います。
+  DEFAULT_CAPACITY = 4096
+
+  attr_reader :capacity
+
+  def initialize(capacity = DEFAULT_CAPACITY)
+    # 枠の位置をビット演算で求められるように2の累乗に切り上げます。
+    @capacity = 1
+    @capacity <<= 1 while @capacity < capacity
+    @mask = @capacity - 1
+    @cursor = Pointer.new(:long_long)
+    @cursor[0] = 0
+    # MARK: Rubyの配列は複数スレッドからの書き込みに耐えないので、数値はCの配列に置きます。
+    @sequences = Pointer.new(:long_long, @capacity)
+    @times = Pointer.new(:double, @capacity)
+    @durations = Pointer.new(:double, @capacity)
+    @codes = Pointer.new(:long_long, @capacity)
+    # MARK: Cの配列に入れたオブジェクトは保持されないので、オブジェクトだけは最初に大きさを決めたRubyの配列に置きます。
+    # 大きさが変わらなければ、別々の枠への代入が重なっても構いません。
+    @objects = Array.new(@capacity)
+    @capacity.times { |slot| @sequences[slot] = 0 }
+    @clearedThrough = 0
+    self
+  end
+
+  # 1件書き込みます。どのスレッドから呼び出しても構いません。
+  def append(time, duration, code, object)
+    sequence = OSAtomicIncrement64Barrier(@cursor)
+    slot = (sequence - 1) & @mask
+    # 書き込み中であることを示してから中身を書き、最後に通し番号を公開します。
+    @sequences[slot] = 0
+    OSMemoryBarrier()
+    @times[slot] = time
+    @durations[slot] = duration
+    @codes[slot] = code
+    @objects[slot] = object
+    OSMemoryBarrier()
+    @sequences[slot] = sequence
+    sequence
+  end
+
+  # これまでに書き込まれた件数です。(上書きされた分も含みます)
+  def count
+    @cursor[0]
+  end
+
+  # 読み出される前に上書きされて失われた件数です。
+  def overwritten
+    [count - @capacity, 0].max
+  end
+
+  # 以降の読み出しで、ここまでに書き込まれたものを返さないようにします。
+  def clear
+    @clearedThrough = count
+  end
+
+  # 古い順に time, duration, code, object を渡します。
+  # 読んでいる途中で上書きされた枠は読み飛ばします。
+  def each
+    last = count
+    first = [last - @capacity, @clearedThrough].max + 1
+    (first..last).each do |sequence|
+      slot = (sequence - 1) & @mask
+      next unless @sequences[slot] == sequence
+      time = @times[slot]
+      duration = @durations[slot]
+      code = @codes[slot]
+      object = @objects[slot]
+      OSMemoryBarrier()
+      next unless @sequences[slot] == sequence
+      yield time, duration, code, object
+    end
+  end
+
+end
@@ -6,12 +6,16 @@ class WifiConnector
 
   attr_accessor :ssid, :bssid, :monitoring, :reachability, :networkStatus, :cameraResponded
 
-  def initialize
+  # probe はカメラへの問い合わせ先を差し替える時に渡します。(tools/camera_stand_in.rb を相手にする時など)
+  def initialize(probe = CameraProbe.new)
     @ssid = nil
     @bssid = nil
     @reachability = Reachability.reachabilityForLocalWiFi
     @networkStatus = NotReachable
     @cameraResponded = false
+    @probe = probe
+    @disconnectionWaiters = []
+    @waitersQueue = Dispatch::Queue.new("#{App::ENV['APP_IDENTIFIER']}.WifiConnector.waiters")
 
     notificationCenter = NSNotificationCenter.defaultCenter
     notificationCenter.addObserver(self, selector:'reachabilityChanged:', name:'kReachabilityChangedNotification', object:nil)
@@ -23,6 +27,7 @@ class WifiConnector
     notificationCenter = NSNotificationCenter.defaultCenter
     notificationCenter.removeObserver(self, name:'kReachabilityChangedNotification', object:nil)
 
+    @probe.invalidate
     @reachabilityQueue = nil
     @reachability = nil
     @ssid = nil
@@ -90,92 +95,86 @@ class WifiConnector
     @monitoring = false
   end
 
+  # カメラにアクセスできるWi-Fi接続が有効になるまで待ちます。
+  # MARK: ポーリングはせず、経路の変化とカメラの応答をきっかけに判定します。
   def waitForConnected(timeout)
     dp "timeout=#{timeout}"
-
-    # 監視を一時的に停止します。
-    if @monitoring
-      weakSelf = WeakRef.new(self)
-      Dispatch::Queue.concurrent.async {
-        Dispatch::Queue.main.async {
-          weakSelf.reachability.stopNotifier
-        }
-      }
-    end
-
-    # 接続状態の変化をポーリングします。
+    sema = Dispatch::Semaphore.new(0)
     connected = false
-    waitStartTime = Time.now
-    while (Time.now - waitStartTime < timeout)
-      updateStatusWithToPingCamera(true)
-      if @networkStatus == ReachableViaWiFi && @cameraResponded
-        connected = true
-        break
-      end
-      sleep(0.05)
+    probeCamera(timeout) do |responded, elapsed|
+      connected = responded
+      sema.signal
     end
+    sema.wait
+    connected
+  end
 
-    # 監視を再開します。
-    if @monitoring
-      weakSelf = WeakRef.new(self)
-      Dispatch::Queue.concurrent.async {
-        Dispatch::Queue.main.async {
-          weakSelf.reachability.startNotifier
-        }
-      }
+  # カメラにアクセスできるWi-Fi接続が有効になったら handler.call(true, elapsed) を呼び出します。
+  # timeout秒の間に有効にならなければ handler.call(false, elapsed) です。すぐに戻ります。
+  def probeCamera(timeout, &handler)
+    weakSelf = WeakRef.new(self)
+    @probe.probe(timeout) do |responded, elapsed|
+      weakSelf.updateStatusWithCameraResponded(responded)
+      handler.call(responded, elapsed)
     end
+  end
 
-    connected
+  def cancelProbingCamera
+    @probe.cancel
   end
 
   def waitForDisconnected(timeout)
     dp "timeout=#{timeout}"
 
-    # 監視を一時的に停止します。
-    if @monitoring
-      weakSelf = WeakRef.new(self)
-      Dispatch::Queue.concurrent.async {
-        Dispatch::Queue.main.async {
-          weakSelf.reachability.stopNotifier
-        }
-      }
-    end
-
-    # 接続状態の変化をポーリングします。
-    disconnected = false
-    waitStartTime = Time.now
-    while (Time.now - waitStartTime < timeout)
-      # MARK: カメラの電源オフ中にCGIコマンドを送信するとカメラが電源オフにならないようです。
-      # ここでは、カメラへCGIコマンドを送らないように電源オフ(Wi-Fi切断)を待つようにしています。
-      self.updateStatusWithToPingCamera(false)
-      if @networkStatus == NotReachable || !@cameraResponded
-        disconnected = true
-        break
-      end
-      sleep(0.05)
-    end
+    # MARK: カメラの電源オフ中にCGIコマンドを送信するとカメラが電源オフにならないようです。
+    # ここでは、カメラへCGIコマンドを送らないように電源オフ(Wi-Fi切断)を待つようにしています。
+    disconnectedNow = -> {
+      updateStatusWithToPingCamera(false)
+      @networkStatus == NotReachable || !@cameraResponded
+    }
+    return true if disconnectedNow.call
 
-    # 監視を再開します。
-    if @monitoring
-      weakSelf = WeakRef.new(self)
-      Dispatch::Queue.concurrent.async {
-        Dispatch::Queue.main.async {
-          weakSelf.reachability.startNotifier
-        }
-      }
-    end
+    # 接続状態の変化の通知を待ちます。
+    sema = Dispatch::Semaphore.new(0)
+    @waitersQueue.sync { @disconnectionWaiters << sema }
+    Dispatch::Queue.main.async {
+      @reachability.startNotifier
+    } unless @monitoring
+    # 登録する前に切断されていた場合に備えて、もう一度確かめます。
+    disconnected = disconnectedNow.call
+    deadline = CACurrentMediaTime() + timeout
+    until disconnected
+      remaining = deadline - CACurrentMediaTime()
+      break if remaining <= 0 || !sema.wait(remaining)
+      disconnected = disconnectedNow.call
+    end
+    @waitersQueue.sync { @disconnectionWaiters.delete(sema) }
+    Dispatch::Queue.main.async {
+      @reachability.stopNotifier
+    } unless @monitoring
 
     disconnected
   end
 
   # Wi-Fi接続の状態が変化した時に呼び出されます。
   def reachabilityChanged(notification)
+    # MARK: CameraProbeが使っているReachabilityの通知も届くので、自分のもの以外は無視します。
+    return unless notification.object == @reachability
     weakSelf = WeakRef.new(self)
     Dispatch::Queue.concurrent.async {
-      weakSelf.updateStatusWithToPingCamera(true)
+      # 切断を待っている間はカメラに問い合わせません。
+      waiters = weakSelf.disconnectionWaiters
+      weakSelf.updateStatusWithToPingCamera(waiters.empty?)
+      waiters.each { |sema| sema.signal }
     }
   end
 
+  def disconnectionWaiters
+    waiters = nil
+    @waitersQueue.sync { waiters = @disconnectionWaiters.dup }
+    waiters
+  end
+
   # 接続状態を更新します。
   def updateStatusWithToPingCamera(ping)
     previousNetworkStatus = @networkStatus
@@ -196,6 +195,22 @@ class WifiConnector
     end
 
     # 状態に変化があった時にだけ通知します。
+    postNotificationIfChanged(previousNetworkStatus, previousCameraResponded)
+  end
+
+  # カメラへの問い合わせ結果で接続状態を更新します。
+  def updateStatusWithCameraResponded(responded)
+    previousNetworkStatus = @networkStatus
+    previousCameraResponded = @cameraResponded
+    @networkStatus = @reachability.currentReachabilityStatus
+    # MARK: 経路の判定よりも先にカメラが応答することがあるので、応答があればWi-Fi接続済とみなします。
+    @networkStatus = ReachableViaWiFi if responded
+    @cameraResponded = responded
+    retreiveSSID
+    postNotificationIfChanged(previousNetworkStatus, previousCameraResponded)
+  end
+
+  def postNotificationIfChanged(previousNetworkStatus, previousCameraResponded)
     if @networkStatus != previousNetworkStatus || @cameraResponded != previousCameraResponded
       Dispatch::Queue.main.async {
         NSNotificationCenter.defaultCenter.postNotificationName(WifiStatusChangedNotification, object:self)
@@ -225,38 +240,12 @@ class WifiConnector
     # 通信仕様書に従って、
     # 単発かつその後の動作に影響の少ないと思われるCGIコマンドをカメラへ送信してそのレスポンスを確認します。
     # 通信仕様書に沿った期待したレスポンスが返って来れば、このWi-Fiはカメラに接続していると判定します。
-    cameraIPAddress = "192.168.0.10" # カメラのIPアドレス
+    # MARK: 経路の確認とCGIコマンドの問い合わせはCameraProbeが同時に行います。
     timeout = 3.0; # このタイムアウト秒数は暫定の値です。(値が短すぎると誤判断する)
-
-    dp "カメラのIPアドレスへのルーティングがあるかを確認します。"
-    reachability = Reachability.reachabilityWithHostName(cameraIPAddress)
-    waitStartTime = Time.now
-    while (reachability.currentReachabilityStatus == NotReachable && Time.now - waitStartTime < timeout)
-      sleep(0.05)
-    end
-    if reachability.currentReachabilityStatus != ReachableViaWiFi
-      dp "timed out"
-      return false
-    end
-
-    client = AFMotion::Client.build("http://#{cameraIPAddress}/") do
-      header "Accept",     "text/xml"
-      header "User-Agent", "OlympusCameraKit"
-      response_serializer :xml
-    end
-    # ↓同期実行する1/2
-    client.completionQueue = Dispatch::Queue.concurrent.dispatch_object
-    # ↓同期実行する2/2
     sema = Dispatch::Semaphore.new(0)
     connected = false
-    client.get("get_connectmode.cgi") do |result|
-      if result.success? && result.body.match('<connectmode>OPC</connectmode>')
-        connected = true
-      # elsif result.operation.response.statusCode.to_s =~ /40\d/
-      #   connected = false
-      elsif result.failure?
-        connected = false
-      end
+    @probe.probe(timeout) do |responded, elapsed|
+      connected = responded
       sema.signal
     end
     sema.wait
@@ -0,0 +1,142 @@
+module MagnifyingAreaConcern
+
+  # 拡大倍率の列挙値ごとの実際の倍率です。
+  MAGNIFYING_FACTORS = {
+    OLYCameraMagnifyingLiveViewScaleX5  => 5.0,
+    OLYCameraMagnifyingLiveViewScaleX7  => 7.0,
+    OLYCameraMagnifyingLiveViewScaleX10 => 10.0,
+    OLYCameraMagnifyingLiveViewScaleX14 => 14.0
+  }
+
+  # 1回の表示範囲移動で動く量の初期値です。(表示範囲の大きさに対する割合)
+  # 実際の量はカメラに問い合わせた結果から学習します。
+  DEFAULT_SCROLL_STEP = 1.0
+
+  # 位置が端に着いているとみなす誤差です。
+  EDGE_EPSILON = 0.001
+
+  #
+  # 拡大ビューの表示範囲を、カメラに問い合わせずに手元で計算します。
+  # 座標はすべてビューファインダー座標系(ライブビュー全体を幅1.0・高さ1.0とする)です。
+  # カメラに問い合わせた時はその値で上書きして、倍率と移動量のずれを学習します。
+  #
+
+  def magnifyingDisplayAreaRect
+    @magnifyingDisplayAreaRect || CGRectZero
+  end
+
+  def magnifyingOverallViewSize
+    @magnifyingOverallViewSize || CGSizeZero
+  end
+
+  # 1回の表示範囲移動で動く量です。(表示範囲の大きさに対する割合)
+  def magnifyingScrollStep
+    @magnifyingScrollStep || CGSizeMake(DEFAULT_SCROLL_STEP, DEFAULT_SCROLL_STEP)
+  end
+
+  # 中心をpointにして倍率scaleで拡大した時の表示範囲です。
+  def magnifyingDisplayAreaRectAt(point, scale)
+    unit = @magnifyingUnitSize || CGSizeMake(1.0, 1.0)
+    factor = MAGNIFYING_FACTORS[scale] || MAGNIFYING_FACTORS[OLYCameraMagnifyingLiveViewScaleX5]
+    width = [unit.width / factor, 1.0].min
+    height = [unit.height / factor, 1.0].min
+    clampMagnifyingDisplayArea(CGRectMake(point.x - width / 2, point.y - height / 2, width, height))
+  end
+
+  # 表示範囲がライブビューからはみ出さないようにします。
+  def clampMagnifyingDisplayArea(rect)
+    x = [[rect.origin.x, 0.0].max, 1.0 - rect.size.width].min
+    y = [[rect.origin.y, 0.0].max, 1.0 - rect.size.height].min
+    CGRectMake(x, y, rect.size.width, rect.size.height)
+  end
+
+  # 拡大を止めた時に呼び出します。forgetがtrueなら学習した倍率と移動量も捨てます。(別のカメラにつないだ時など)
+  def resetMagnifyingArea(forget = false)
+    @magnifyingOverallViewSize = CGSizeZero
+    @magnifyingDisplayAreaRect = CGRectZero
+    @magnifyingFactor = nil
+    @magnifyingSyncedRect = nil
+    @magnifyingScrolls = [0, 0]
+    if forget
+      @magnifyingUnitSize = nil
+      @magnifyingScrollStep = nil
+    end
+  end
+
+  def trackMagnifyingStart(point, scale)
+    @magnifyingDisplayAreaRect = magnifyingDisplayAreaRectAt(point, scale)
+    @magnifyingFactor = MAGNIFYING_FACTORS[scale]
+    @magnifyingLiveViewScale = scale
+    # 位置を手元で決めたので、次に問い合わせるまで移動量は学習できません。
+    @magnifyingSyncedRect = nil
+    @magnifyingScrolls = [0, 0]
+  end
+
+  # 倍率の変更は表示範囲の中心を保ったまま行われるものとします。
+  def trackMagnifyingScale(scale)
+    rect = magnifyingDisplayAreaRect
+    trackMagnifyingStart(CGPointMake(CGRectGetMidX(rect), CGRectGetMidY(rect)), scale)
+  end
+
+  def trackMagnifyingScroll(direction)
+    rect = magnifyingDisplayAreaRect
+    step = magnifyingScrollStep
+    dx = 0
+    dy = 0
+    case direction
+    when OLYCameraMagnifyingLiveViewScrollDirectionUp    then dy = -1
+    when OLYCameraMagnifyingLiveViewScrollDirectionDown  then dy = 1
+    when OLYCameraMagnifyingLiveViewScrollDirectionLeft  then dx = -1
+    when OLYCameraMagnifyingLiveViewScrollDirectionRight then dx = 1
+    end
+    @magnifyingScrolls ||= [0, 0]
+    @magnifyingScrolls[0] += dx
+    @magnifyingScrolls[1] += dy
+    @magnifyingDisplayAreaRect = clampMagnifyingDisplayArea(CGRectMake(
+      rect.origin.x + dx * rect.size.width * step.width,
+      rect.origin.y + dy * rect.size.height * step.height,
+      rect.size.width, rect.size.height))
+  end
+
+  # カメラに問い合わせた表示範囲を取り込みます。magnifyingLiveViewAreaの戻り値を渡します。
+  def trackMagnifyingArea(area)
+    return false if !area || !area[OLYCameraMagnifyingOverallViewSizeKey] || !area[OLYCameraMagnifyingDisplayAreaRectKey]
+    overallViewSize = area[OLYCameraMagnifyingOverallViewSizeKey]
+    overallViewSize = overallViewSize.CGSizeValue if overallViewSize.respond_to?(:CGSizeValue)
+    rect = area[OLYCameraMagnifyingDisplayAreaRectKey]
+    rect = rect.CGRectValue if rect.respond_to?(:CGRectValue)
+    learnMagnifyingGeometry(rect)
+    @magnifyingOverallViewSize = overallViewSize
+    @magnifyingDisplayAreaRect = rect
+    @magnifyingSyncedRect = rect
+    @magnifyingScrolls = [0, 0]
+    true
+  end
+
+  private
+
+  def learnMagnifyingGeometry(rect)
+    if @magnifyingFactor
+      @magnifyingUnitSize = CGSizeMake(rect.size.width * @magnifyingFactor, rect.size.height * @magnifyingFactor)
+    end
+    synced = @magnifyingSyncedRect
+    scrolls = @magnifyingScrolls || [0, 0]
+    return unless synced
+    step = magnifyingScrollStep
+    # 端で止められた移動からは学習しません。
+    width = step.width
+    if scrolls[0] != 0 && !touchesMagnifyingEdge(synced.origin.x, synced.size.width) && !touchesMagnifyingEdge(rect.origin.x, rect.size.width)
+      width = (rect.origin.x - synced.origin.x).abs / (scrolls[0].abs * rect.size.width)
+    end
+    height = step.height
+    if scrolls[1] != 0 && !touchesMagnifyingEdge(synced.origin.y, synced.size.height) && !touchesMagnifyingEdge(rect.origin.y, rect.size.height)
+      height = (rect.origin.y - synced.origin.y).abs / (scrolls[1].abs * rect.size.height)
+    end
+    @magnifyingScrollStep = CGSizeMake(width, height) if width > 0 && height > 0
+  end
+
+  def touchesMagnifyingEdge(origin, length)
+    origin <= EDGE_EPSILON || origin + length >= 1.0 - EDGE_EPSILON
+  end
+
+end
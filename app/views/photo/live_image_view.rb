@@ -1,6 +1,9 @@
 class LiveImageView < UIImageView
   include DebugConcern
 
+  # ヒストグラムを描く時の横軸の点の数です。(256階調をまとめて間引きます)
+  HISTOGRAM_POINTS = 64
+
   def initWithFrame(frame)
     dp "frame=#{NSStringFromCGRect(frame)}"
     super(frame)
@@ -47,6 +50,19 @@ class LiveImageView < UIImageView
     @gridLineWidth = 1.0
     @gridLineOpacity = 1.0
     @gridLineColor = UIColor.colorWithRed(1.0, green:1.0, blue:1.0, alpha:1.0)
+    @zebraOpacity = 0.6
+    @zebraColor = UIColor.colorWithRed(1.0, green:1.0, blue:1.0, alpha:1.0)
+    @peakingOpacity = 1.0
+    @peakingColor = UIColor.colorWithRed(1.0, green:0.2, blue:0.2, alpha:1.0)
+    @histogramSize = CGSizeMake(128.0, 64.0)
+    @histogramMargin = 8.0
+    @histogramBackgroundColor = UIColor.colorWithRed(0.0, green:0.0, blue:0.0, alpha:0.4)
+    @histogramLuminanceColor = UIColor.colorWithRed(1.0, green:1.0, blue:1.0, alpha:0.6)
+    @histogramColors = {
+      red:   UIColor.colorWithRed(1.0, green:0.3, blue:0.3, alpha:0.9),
+      green: UIColor.colorWithRed(0.3, green:1.0, blue:0.3, alpha:0.9),
+      blue:  UIColor.colorWithRed(0.3, green:0.3, blue:1.0, alpha:0.9)
+    }
 
     CATransaction.begin
     CATransaction.setValue(KCFBooleanTrue, forKey:KCATransactionDisableActions)
@@ -70,6 +86,45 @@ class LiveImageView < UIImageView
     # layer.addSublayer(gridLayer)
     # @gridLayer = gridLayer
 
+    # 拡大ビューのプレビューに関する情報を初期化します。
+    # カメラが拡大を終えるまでの間、最後の全体のフレームを切り抜いて拡大したものを重ねます。
+    @showingMagnifyingPreview = false
+    magnifyingPreviewLayer = CALayer.layer
+    magnifyingPreviewLayer.contentsGravity = KCAGravityResize
+    magnifyingPreviewLayer.magnificationFilter = KCAFilterLinear
+    magnifyingPreviewLayer.opacity = 0.0
+    magnifyingPreviewLayer.frame = CGRectZero
+    layer.addSublayer(magnifyingPreviewLayer)
+    @magnifyingPreviewLayer = magnifyingPreviewLayer
+
+    # ゼブラとフォーカスピーキングに関する情報を初期化します。
+    # 塗りつぶしたレイヤーに解析結果のマスクを掛けて、印を付けたピクセルだけを見せます。
+    @showingAnalysis = false
+    @analysisLayout = nil
+    @zebraLayer = analysisOverlayLayer(@zebraColor)
+    @peakingLayer = analysisOverlayLayer(@peakingColor)
+
+    # ヒストグラムに関する情報を初期化します。
+    histogramLayer = CALayer.layer
+    histogramLayer.backgroundColor = @histogramBackgroundColor.CGColor
+    histogramLayer.opacity = 0.0
+    histogramLayer.frame = CGRectZero
+    @histogramShapeLayers = {}
+    luminanceLayer = CAShapeLayer.layer
+    luminanceLayer.fillColor = @histogramLuminanceColor.CGColor
+    histogramLayer.addSublayer(luminanceLayer)
+    @histogramShapeLayers[:luminance] = luminanceLayer
+    @histogramColors.each do |channel, color|
+      channelLayer = CAShapeLayer.layer
+      channelLayer.fillColor = nil
+      channelLayer.strokeColor = color.CGColor
+      channelLayer.lineWidth = 1.0
+      histogramLayer.addSublayer(channelLayer)
+      @histogramShapeLayers[channel] = channelLayer
+    end
+    layer.addSublayer(histogramLayer)
+    @histogramLayer = histogramLayer
+
     # AF有効枠に関する情報を初期化します。
     @showingAutoFocusEffectiveArea = false
     @autoFocusEffectiveAreaRect = CGRectMake(0.0, 0.0, 1.0, 1.0)
@@ -458,5 +513,149 @@ class LiveImageView < UIImageView
     self.showFocusFrame(rect, status:status, duration:0.0, animated:animated)
   end
 
+  # ライブビューの解析結果(LiveViewAnalyzer#analyze)を表示します。
+  # MARK: 毎フレーム呼び出されるので、アニメーションはしません。
+  def showAnalysis(analysis)
+    return unless self.image
+
+    CATransaction.begin
+    CATransaction.setValue(KCFBooleanTrue, forKey:KCATransactionDisableActions)
+    layoutAnalysisLayers(analysis)
+    # プレビューを見せている間は、下のフレームの解析結果と位置が合わないので隠します。
+    showAnalysisMask(@zebraLayer, @showingMagnifyingPreview ? nil : analysis[:zebraMask], @zebraOpacity)
+    showAnalysisMask(@peakingLayer, @showingMagnifyingPreview ? nil : analysis[:peakingMask], @peakingOpacity)
+    if analysis[:histogram]
+      showHistogram(analysis[:histogram])
+      @histogramLayer.opacity = 1.0
+    else
+      @histogramLayer.opacity = 0.0
+    end
+    CATransaction.commit
+
+    @showingAnalysis = true
+  end
+
+  def hideAnalysis
+    CATransaction.begin
+    CATransaction.setValue(KCFBooleanTrue, forKey:KCATransactionDisableActions)
+    @zebraLayer.opacity = 0.0
+    @peakingLayer.opacity = 0.0
+    @histogramLayer.opacity = 0.0
+    CATransaction.commit
+
+    @showingAnalysis = false
+  end
+
+  def analysisOverlayLayer(color)
+    overlayLayer = CALayer.layer
+    overlayLayer.backgroundColor = color.CGColor
+    overlayLayer.opacity = 0.0
+    overlayLayer.frame = CGRectZero
+    maskLayer = CALayer.layer
+    maskLayer.contentsGravity = KCAGravityResize
+    # 拡大して表示しても印がにじまないようにします。
+    maskLayer.magnificationFilter = KCAFilterNearest
+    overlayLayer.mask = maskLayer
+    layer.addSublayer(overlayLayer)
+    overlayLayer
+  end
+
+  # 解析結果の重ね合わせを画像の表示範囲に合わせます。画像のサイズか向きが変わった時だけ計算し直します。
+  def layoutAnalysisLayers(analysis)
+    viewSize = self.bounds.size
+    layout = [analysis[:width], analysis[:height], analysis[:orientation], viewSize.width, viewSize.height]
+    return if @analysisLayout == layout
+    @analysisLayout = layout
+
+    imageSize = self.image.size
+    rect = self.convertRectFromImageArea(CGRectMake(0.0, 0.0, imageSize.width, imageSize.height))
+    # カメラが天地逆の時は画像が回転して表示されるので、解析結果も同じように回します。
+    transform = (analysis[:orientation] == UIImageOrientationDown) ? CGAffineTransformMakeRotation(Math::PI) : CGAffineTransformIdentity
+    [@zebraLayer, @peakingLayer].each do |overlayLayer|
+      overlayLayer.setAffineTransform(CGAffineTransformIdentity)
+      overlayLayer.bounds = CGRectMake(0.0, 0.0, rect.size.width, rect.size.height)
+      overlayLayer.position = CGPointMake(CGRectGetMidX(rect), CGRectGetMidY(rect))
+      overlayLayer.setAffineTransform(transform)
+      overlayLayer.mask.frame = overlayLayer.bounds
+    end
+    @histogramLayer.frame = CGRectMake(rect.origin.x + @histogramMargin, CGRectGetMaxY(rect) - @histogramMargin - @histogramSize.height, @histogramSize.width, @histogramSize.height)
+    @histogramShapeLayers.each_value { |shapeLayer| shapeLayer.frame = @histogramLayer.bounds }
+  end
+
+  def showAnalysisMask(overlayLayer, mask, opacity)
+    if mask
+      overlayLayer.mask.contents = mask
+      overlayLayer.opacity = opacity
+    else
+      overlayLayer.opacity = 0.0
+    end
+  end
+
+  # 拡大ビューの表示範囲(ビューファインダー座標系)をimageから切り抜いて拡大して見せます。
+  # imageは拡大する前に受け取った全体のフレームです。
+  def showMagnifyingPreview(image, rect)
+    return unless self.image && image && image.CGImage
+
+    CATransaction.begin
+    CATransaction.setValue(KCFBooleanTrue, forKey:KCATransactionDisableActions)
+    imageSize = self.image.size
+    frame = self.convertRectFromImageArea(CGRectMake(0.0, 0.0, imageSize.width, imageSize.height))
+    # ビューファインダー座標系は回転する前の画像の座標なので、天地逆の時はレイヤーごと回します。
+    transform = (image.imageOrientation == UIImageOrientationDown) ? CGAffineTransformMakeRotation(Math::PI) : CGAffineTransformIdentity
+    @magnifyingPreviewLayer.setAffineTransform(CGAffineTransformIdentity)
+    @magnifyingPreviewLayer.bounds = CGRectMake(0.0, 0.0, frame.size.width, frame.size.height)
+    @magnifyingPreviewLayer.position = CGPointMake(CGRectGetMidX(frame), CGRectGetMidY(frame))
+    @magnifyingPreviewLayer.setAffineTransform(transform)
+    @magnifyingPreviewLayer.contents = image.CGImage
+    @magnifyingPreviewLayer.contentsRect = rect
+    @magnifyingPreviewLayer.opacity = 1.0
+    @zebraLayer.opacity = 0.0
+    @peakingLayer.opacity = 0.0
+    CATransaction.commit
+
+    @showingMagnifyingPreview = true
+  end
+
+  def hideMagnifyingPreview
+    return unless @showingMagnifyingPreview
+
+    CATransaction.begin
+    CATransaction.setValue(KCFBooleanTrue, forKey:KCATransactionDisableActions)
+    @magnifyingPreviewLayer.opacity = 0.0
+    @magnifyingPreviewLayer.contents = nil
+    CATransaction.commit
+
+    @showingMagnifyingPreview = false
+  end
+
+  # 輝度は塗りつぶし、RGBは線で描きます。一番多い階調が上端に届くように縦軸を合わせます。
+  def showHistogram(histogram)
+    points = {}
+    histogram.each do |channel, bins|
+      group = bins.size / HISTOGRAM_POINTS
+      points[channel] = (0...HISTOGRAM_POINTS).map { |i| bins[i * group, group].inject(0) { |sum, value| sum + value } }
+    end
+    peak = points.values.map(&:max).max
+    return if !peak || peak == 0
+    points.each do |channel, values|
+      @histogramShapeLayers[channel].path = histogramPath(values, peak, channel == :luminance)
+    end
+  end
+
+  def histogramPath(values, peak, closed)
+    width = @histogramSize.width
+    height = @histogramSize.height
+    path = UIBezierPath.bezierPath
+    path.moveToPoint(CGPointMake(0.0, height)) if closed
+    values.each_with_index do |value, i|
+      point = CGPointMake(width * i / (values.size - 1), height - height * value / peak)
+      (i == 0 && !closed) ? path.moveToPoint(point) : path.addLineToPoint(point)
+    end
+    if closed
+      path.addLineToPoint(CGPointMake(width, height))
+      path.closePath
+    end
+    path.CGPath
+  end
 
 end
@@ -139,6 +139,7 @@ class PanelView < UIView
   end
 
   def releaseShutter
+    NSNotificationCenter.defaultCenter.postNotificationName('ReleaseShutterButtonWasTapped', object:self)
   end
 
   def closePhotoView
@@ -0,0 +1,97 @@
+describe "AppCameraLog" do
+
+  it "keeps only the newest records in order once the ring is full" do
+    buffer = TraceRingBuffer.new(6)
+    buffer.capacity.should == 8
+    (1..20).each { |i| buffer.append(i.to_f, 0.0, i, "message #{i}") }
+    records = []
+    buffer.each { |time, duration, code, object| records << [code, object] }
+    records.map(&:first).should == (13..20).to_a
+    records.last.last.should == "message 20"
+    buffer.overwritten.should == 12
+    buffer.clear
+    buffer.append(21.0, 0.0, 21, "message 21")
+    codes = []
+    buffer.each { |time, duration, code, object| codes << code }
+    codes.should == [21]
+  end
+
+  it "does not lose or tear records written from several threads" do
+    threads = 4
+    perThread = 2000
+    buffer = TraceRingBuffer.new(threads * perThread)
+    group = Dispatch::Group.new
+    threads.times do |thread|
+      Dispatch::Queue.concurrent.async(group) {
+        perThread.times { |i| buffer.append(i.to_f, 0.0, thread * perThread + i, thread) }
+      }
+    end
+    group.wait
+    buffer.count.should == threads * perThread
+    codes = []
+    buffer.each do |time, duration, code, object|
+      # 同じ記録の中身が別々の書き込みから混ざっていないこと
+      (code / perThread).should == object
+      (code % perThread).to_f.should == time
+      codes << code
+    end
+    codes.sort.should == (0...threads * perThread).to_a
+  end
+
+  it "formats the timestamp only when the messages are read" do
+    log = AppCameraLog.alloc.init
+    log.log(nil, shouldOutputMessage:"connected", level:1)
+    messages = log.messages
+    messages.size.should == 1
+    messages.first.should =~ /\A\d\d:\d\d:\d\d\.\d\d\d connected\z/
+    log.clearMessages
+    log.messages.should == []
+  end
+
+  it "exports spans as Chrome trace events" do
+    trace = AppCameraTrace.alloc.init
+    # ブロックの戻り値はそのまま返し、かかった時間を区間として記録します。
+    trace.measure('changeRunMode 1') { sleep(0.01); :ok }.should == :ok
+    measured = trace.chromeTraceEvents(false)
+    measured.map { |event| event['name'] }.should == ['changeRunMode 1']
+    measured.first['dur'].should >= 10_000
+    span = trace.start('takePicture')
+    trace.finish(span)
+    events = trace.chromeTraceEvents(false)
+    events.map { |event| event['name'] }.should == ['changeRunMode 1', 'takePicture']
+    events.first['ph'].should == 'X'
+    json = NSJSONSerialization.JSONObjectWithData(trace.chromeTraceData(false), options:0, error:nil)
+    json['traceEvents'].size.should == 2
+  end
+
+  # 4スレッドから同時にログを書き込んだ時の1回あたりの時間を、以前の実装(都度NSDateFormatterを作って配列に追加)と比べます。
+  it "logs faster than formatting every message under contention" do
+    threads = 4
+    perThread = 5000
+    contend = ->(&block) {
+      group = Dispatch::Group.new
+      startTime = CACurrentMediaTime()
+      threads.times do
+        Dispatch::Queue.concurrent.async(group) { perThread.times { |i| block.call(i) } }
+      end
+      group.wait
+      (CACurrentMediaTime() - startTime) / (threads * perThread) * 1_000_000_000
+    }
+
+    log = AppCameraLog.alloc.init
+    ring = contend.call { |i| log.log(nil, shouldOutputMessage:"message", level:1) }
+
+    messages = []
+    lock = Dispatch::Queue.new('AppCameraLogSpec.lock')
+    formatted = contend.call { |i|
+      formatter = NSDateFormatter.alloc.init
+      formatter.setTimeZone(NSTimeZone.localTimeZone)
+      formatter.setDateFormat("HH:mm:ss.SSS")
+      message = "#{formatter.stringFromDate(NSDate.date)} message"
+      lock.sync { messages << message }
+    }
+    puts "log per call with #{threads} threads: ring=#{ring.round}ns, formatted=#{formatted.round}ns"
+    ring.should < formatted
+  end
+
+end
@@ -0,0 +1,190 @@
+describe "CameraConnectionStateMachine" do
+
+  # カメラキットの代わりに、呼び出された操作を記録するだけのカメラです。
+  class StubCamera
+    attr_accessor :bluetoothPeripheral, :bluetoothPassword, :bluetoothPrepareForRecordingWhenPowerOn, :wakeupDelay, :connectDelay, :calls
+    attr_accessor :failingCall
+    def initialize
+      @calls = []
+      @wakeupDelay = 0.0
+      @connectDelay = 0.0
+      @failingCall = nil
+    end
+    def wakeup(error)
+      @calls << :wakeup
+      sleep(@wakeupDelay)
+      @failingCall != :wakeup
+    end
+    def connect(connectionType, error:error)
+      @calls << :connect
+      sleep(@connectDelay)
+      true
+    end
+    def changeTime(time, error:error)
+      @calls << :changeTime
+      @failingCall != :changeTime
+    end
+    def changeRunMode(mode, error:error)
+      @calls << :changeRunMode
+      @failingCall != :changeRunMode
+    end
+    def disconnectWithPowerOff(powerOff, error:error)
+      @calls << :disconnect
+      true
+    end
+  end
+
+  # 指定した秒数が経つとカメラが応答したことにするWi-Fiです。nilなら応答しません。
+  # timeoutAfterを指定すると、応答がないことをその秒数で知らせます。
+  class StubWifiConnector
+    attr_reader :cancelled
+    def initialize(readyAfter, timeoutAfter = nil)
+      @readyAfter = readyAfter
+      @timeoutAfter = timeoutAfter
+      @cancelled = 0
+    end
+    def probeCamera(timeout, &handler)
+      delay = @readyAfter || @timeoutAfter || timeout
+      Dispatch::Queue.concurrent.after(delay) { handler.call(!!@readyAfter, delay) }
+    end
+    def cancelProbingCamera
+      @cancelled += 1
+    end
+  end
+
+  class StubBluetoothConnector
+    attr_accessor :services, :localName, :peripheral, :discoverDelay
+    attr_reader :cancelled
+    def initialize(discoverDelay = 0.0)
+      @discoverDelay = discoverDelay
+      @status = 'BluetoothConnectionStatusNotFound'
+      @cancelled = 0
+    end
+    def connectionStatus
+      @status
+    end
+    def discoverPeripheral(error)
+      sleep(@discoverDelay)
+      @status = 'BluetoothConnectionStatusNotConnected'
+      true
+    end
+    def connectPeripheral(error)
+      @status = 'BluetoothConnectionStatusConnected'
+      true
+    end
+    def disconnectPeripheral(error)
+      @status = 'BluetoothConnectionStatusNotFound'
+      true
+    end
+    def cancelWaiting
+      @cancelled += 1
+    end
+  end
+
+  def run(machine, wakeUp)
+    sema = Dispatch::Semaphore.new(0)
+    result = nil
+    machine.completionHandler = ->(connected, failure, error) { result = connected; sema.signal }
+    machine.start(wakeUp, bluetoothLocalName:'E-M1-TEST', bluetoothPasscode:'123456')
+    sema.wait
+    result
+  end
+
+  it "records timestamped transitions while connecting over Wi-Fi" do
+    camera = StubCamera.new
+    machine = CameraConnectionStateMachine.new(camera, StubWifiConnector.new(0.05))
+    run(machine, false).should == true
+    machine.transitions.map { |t| t[:to] }.should == [:joiningWifi, :connecting, :configuring, :connected]
+    elapsed = machine.transitions.map { |t| t[:elapsed] }
+    elapsed.should == elapsed.sort
+    machine.elapsedUntil(:connecting).should >= 0.05
+    camera.calls.should == [:connect, :changeTime, :changeRunMode]
+  end
+
+  it "skips waking the camera up when it already answers over Wi-Fi" do
+    camera = StubCamera.new
+    machine = CameraConnectionStateMachine.new(camera, StubWifiConnector.new(0.05), StubBluetoothConnector.new(0.5))
+    run(machine, true).should == true
+    machine.elapsedUntil(:connected).should < 0.4
+    camera.calls.include?(:wakeup).should == false
+  end
+
+  it "joins Wi-Fi while the camera is waking up" do
+    camera = StubCamera.new
+    camera.wakeupDelay = 0.3
+    machine = CameraConnectionStateMachine.new(camera, StubWifiConnector.new(0.2), StubBluetoothConnector.new)
+    run(machine, true).should == true
+    # 電源投入の後からWi-Fiを待っていたら0.5秒かかるところです。
+    machine.elapsedUntil(:connecting).should < 0.45
+    machine.transitions.map { |t| t[:to] }.include?(:joiningWifi).should == false
+  end
+
+  it "can be cancelled while waiting for Wi-Fi" do
+    machine = CameraConnectionStateMachine.new(StubCamera.new, StubWifiConnector.new(nil))
+    machine.start(false, bluetoothLocalName:nil, bluetoothPasscode:nil)
+    machine.cancel
+    machine.state.should == :cancelled
+    machine.transitions.last[:event].should == :cancel
+  end
+
+  it "disconnects an app connection that finishes after being cancelled" do
+    camera = StubCamera.new
+    camera.connectDelay = 0.2
+    machine = CameraConnectionStateMachine.new(camera, StubWifiConnector.new(0.0))
+    machine.start(false, bluetoothLocalName:nil, bluetoothPasscode:nil)
+    sleep(0.1)
+    machine.state.should == :connecting
+    machine.cancel
+    sleep(0.3)
+    camera.calls.should == [:connect, :disconnect]
+  end
+
+  it "tells which configuration step failed" do
+    [:changeTime, :changeRunMode].each do |step|
+      camera = StubCamera.new
+      camera.failingCall = step
+      machine = CameraConnectionStateMachine.new(camera, StubWifiConnector.new(0.0))
+      run(machine, false).should == false
+      machine.failure.should == step
+    end
+  end
+
+  it "stops probing Wi-Fi when waking the camera up fails" do
+    camera = StubCamera.new
+    camera.failingCall = :wakeup
+    wifiConnector = StubWifiConnector.new(nil)
+    machine = CameraConnectionStateMachine.new(camera, wifiConnector, StubBluetoothConnector.new)
+    run(machine, true).should == false
+    machine.failure.should == :wakeup
+    wifiConnector.cancelled.should == 1
+  end
+
+  it "stops waiting for Bluetooth when Wi-Fi times out" do
+    bluetoothConnector = StubBluetoothConnector.new(0.5)
+    machine = CameraConnectionStateMachine.new(StubCamera.new, StubWifiConnector.new(nil, 0.1), bluetoothConnector)
+    run(machine, true).should == false
+    machine.failure.should == :wifi
+    bluetoothConnector.cancelled.should == 1
+  end
+
+  # tools/camera_stand_in.rb を起動して、.envにCAMERA_STAND_IN_URLを書いておくと実行されます。
+  if App::ENV['CAMERA_STAND_IN_URL']
+    it "notices a booting camera soon after it comes up" do
+      baseURL = App::ENV['CAMERA_STAND_IN_URL']
+      latencies = (0...20).map do |i|
+        boot = 0.3 + (i % 5) * 0.2
+        NSString.stringWithContentsOfURL(NSURL.URLWithString(baseURL + "control?boot=#{boot}"), encoding:NSUTF8StringEncoding, error:nil)
+        machine = CameraConnectionStateMachine.new(StubCamera.new, WifiConnector.new(CameraProbe.new(baseURL)))
+        run(machine, false).should == true
+        # カメラがWi-Fiに出てきてから接続し終えるまでの時間です。
+        machine.elapsedUntil(:connected) - boot
+      end
+      sorted = latencies.sort
+      p50 = sorted[sorted.size / 2]
+      p95 = sorted[[(sorted.size * 0.95).floor, sorted.size - 1].min]
+      puts "connect latency after boot: p50=#{(p50 * 1000).round}ms, p95=#{(p95 * 1000).round}ms, max=#{(sorted.last * 1000).round}ms"
+      p95.should < CameraProbe::MAX_BACKOFF + 0.2
+    end
+  end
+
+end
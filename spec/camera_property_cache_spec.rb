@@ -0,0 +1,197 @@
+describe "CameraPropertyCache" do
+
+  # 問い合わせのたびに決まった時間待たされるカメラです。呼び出された回数を数えます。
+  class LatentCamera
+    attr_accessor :values, :latency, :reads, :writes, :rejected, :readOnly
+    def initialize(values, latency = 0.0)
+      @values = values.dup
+      @latency = latency
+      @reads = 0
+      @writes = 0
+      # まとめて書き込むと拒否されるプロパティです。(1つずつなら受け付けます)
+      @rejected = []
+      # 今の撮影モードでは書き込めないプロパティです。
+      @readOnly = []
+    end
+    def cameraPropertyValues(names, error:error)
+      @reads += 1
+      sleep(@latency)
+      result = {}
+      names.allObjects.each { |name| result[name] = @values[name] if @values[name] }
+      result
+    end
+    def cameraPropertyValue(name, error:error)
+      @reads += 1
+      sleep(@latency)
+      @values[name]
+    end
+    def setCameraPropertyValues(values, error:error)
+      @writes += 1
+      sleep(@latency)
+      return false if values.size > 1 && values.keys.any? { |name| @rejected.include?(name) }
+      return false if values.keys.any? { |name| @readOnly.include?(name) }
+      @values.merge!(values)
+      true
+    end
+    def canSetCameraProperty(name)
+      !@readOnly.include?(name)
+    end
+  end
+
+  INITIAL = {
+    'TAKEMODE' => '<TAKEMODE/P>',
+    'WB'       => '<WB/WB_AUTO>',
+    'ISO'      => '<ISO/Auto>',
+    'APERTURE' => '<APERTURE/5.6>'
+  }
+
+  it "interns property names and values" do
+    parsed = CameraPropertyCache.parse('<WB/MWB_FINE>')
+    CameraPropertyCache.nameOf(parsed[0]).should == 'WB'
+    CameraPropertyCache.valueOf(parsed[1]).should == '<WB/MWB_FINE>'
+    CameraPropertyCache.parse('<WB/MWB_FINE>').should == parsed
+    CameraPropertyCache.parse('WB_AUTO').should == nil
+  end
+
+  it "reads every property once and answers later reads locally" do
+    camera = LatentCamera.new(INITIAL)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    10.times { cache.valueForName('WB').should == '<WB/WB_AUTO>' }
+    cache.valuesForNames(%w(TAKEMODE ISO)).should == { 'TAKEMODE' => '<TAKEMODE/P>', 'ISO' => '<ISO/Auto>' }
+    camera.reads.should == 1
+    cache.statistics[:readHits].should == 12
+  end
+
+  it "sends only the changed values in a single call" do
+    camera = LatentCamera.new(INITIAL)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    cache.setValues(INITIAL, error:nil).should == true
+    camera.writes.should == 0
+    cache.setValues(INITIAL.merge('WB' => '<WB/MWB_FINE>', 'ISO' => '<ISO/200>'), error:nil).should == true
+    camera.writes.should == 1
+    camera.values['ISO'].should == '<ISO/200>'
+    cache.statistics[:writesSent].should == 2
+    cache.statistics[:writesSkipped].should == 6
+  end
+
+  it "falls back to one call per property when the batch is rejected" do
+    camera = LatentCamera.new(INITIAL)
+    camera.rejected = ['APERTURE']
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    cache.setValues({ 'WB' => '<WB/MWB_FINE>', 'APERTURE' => '<APERTURE/8.0>' }, error:nil).should == true
+    camera.writes.should == 3
+    cache.valueForName('APERTURE').should == '<APERTURE/8.0>'
+  end
+
+  it "refetches properties changed on the camera in one batch" do
+    camera = LatentCamera.new(INITIAL)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    # カメラのダイヤルが回されたことにします。
+    camera.values['APERTURE'] = '<APERTURE/4.0>'
+    camera.values['ISO'] = '<ISO/400>'
+    cache.invalidate('APERTURE')
+    cache.invalidate('ISO')
+    cache.valueForName('APERTURE').should == '<APERTURE/4.0>'
+    cache.valueForName('ISO').should == '<ISO/400>'
+    camera.reads.should == 2
+  end
+
+  it "does not ask the camera when the change notice of its own write arrives" do
+    camera = LatentCamera.new(INITIAL)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    cache.resetStatistics
+    cache.setValues({ 'WB' => '<WB/MWB_FINE>' }, error:nil)
+    cache.invalidate('WB')
+    # 書き込みの1回だけで、知らせを受けても問い合わせません。
+    cache.statistics[:roundTrips].should == 1
+    # カメラのダイヤルが回されたことにします。次に読む時に、書き込んだものと一緒に1回で読み直します。
+    camera.values['ISO'] = '<ISO/400>'
+    cache.invalidate('ISO')
+    cache.valuesForNames(%w(WB ISO)).should == { 'WB' => '<WB/MWB_FINE>', 'ISO' => '<ISO/400>' }
+    cache.statistics[:roundTrips].should == 2
+    cache.statistics[:echoesConfirmed].should == 1
+    cache.statistics[:stale].should == 0
+  end
+
+  it "keeps a change made on the camera right after its own write" do
+    camera = LatentCamera.new(INITIAL)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys)
+    cache.setValues({ 'WB' => '<WB/MWB_FINE>' }, error:nil)
+    # 書き込んだ直後にカメラのボタンで変えられたことにします。
+    camera.values['WB'] = '<WB/MWB_SHADE>'
+    cache.invalidate('WB')
+    cache.valueForName('WB').should == '<WB/MWB_SHADE>'
+    cache.statistics[:echoesConfirmed].should == 0
+  end
+
+  it "leaves out the properties that are read-only in the current take mode" do
+    camera = LatentCamera.new(INITIAL.merge('SHUTTER' => '<SHUTTER/250>'))
+    camera.readOnly = %w(APERTURE SHUTTER)
+    cache = CameraPropertyCache.new(camera)
+    cache.valuesForNames(INITIAL.keys + ['SHUTTER'])
+    snapshot = { 'WB' => '<WB/MWB_FINE>', 'APERTURE' => '<APERTURE/8.0>', 'SHUTTER' => '<SHUTTER/60>' }
+    cache.setValues(snapshot, error:nil).should == false
+    settable = cache.settableValues(snapshot)
+    settable.keys.should == ['WB']
+    cache.setValues(settable, error:nil).should == true
+    camera.values['WB'].should == '<WB/MWB_FINE>'
+    camera.values['APERTURE'].should == '<APERTURE/5.6>'
+  end
+
+  # 撮影モードに5回出入りして、その間に設定を10回切り替えた場合の比較です。
+  it "saves round trips when entering recording mode" do
+    latency = 0.03
+    defaults = INITIAL
+    toggle = ['<WB/WB_AUTO>', '<WB/MWB_FINE>']
+
+    # これまでのやり方: 入るたびに全部書き込み、切り替えのたびに問い合わせます。
+    legacy = LatentCamera.new(INITIAL, latency)
+    startTime = CACurrentMediaTime()
+    entries = 5.times.map do |i|
+      entryTime = CACurrentMediaTime()
+      legacy.setCameraPropertyValues(defaults, error:nil)
+      elapsed = CACurrentMediaTime() - entryTime
+      2.times do
+        current = legacy.cameraPropertyValue('WB', error:nil)
+        legacy.setCameraPropertyValues({ 'WB' => toggle[1 - toggle.index(current)] }, error:nil)
+        # 変更の知らせを受けた画面が表示を更新します。
+        legacy.cameraPropertyValue('WB', error:nil)
+      end
+      elapsed
+    end
+    legacyTime = CACurrentMediaTime() - startTime
+    legacyRoundTrips = legacy.reads + legacy.writes
+
+    camera = LatentCamera.new(INITIAL, latency)
+    cache = CameraPropertyCache.new(camera)
+    startTime = CACurrentMediaTime()
+    cachedEntries = 5.times.map do |i|
+      entryTime = CACurrentMediaTime()
+      cache.valuesForNames(defaults.keys)
+      cache.setValues(defaults, error:nil)
+      elapsed = CACurrentMediaTime() - entryTime
+      2.times do
+        current = cache.valueForName('WB')
+        cache.setValues({ 'WB' => toggle[1 - toggle.index(current)] }, error:nil)
+        cache.invalidate('WB')
+        cache.valueForName('WB')
+      end
+      elapsed
+    end
+    cachedTime = CACurrentMediaTime() - startTime
+    stats = cache.statistics
+
+    puts "legacy: #{legacyRoundTrips} round trips, #{(legacyTime * 1000).round}ms, entry(max)=#{(entries.max * 1000).round}ms"
+    puts "cached: #{stats[:roundTrips]} round trips (#{stats[:roundTripsSaved]} saved), #{(cachedTime * 1000).round}ms, entry(max)=#{(cachedEntries.max * 1000).round}ms"
+    stats[:roundTrips].should == camera.reads + camera.writes
+    stats[:roundTrips].should < legacyRoundTrips
+    cachedEntries.last.should < latency
+  end
+
+end
@@ -0,0 +1,205 @@
+describe "CaptureScheduler" do
+
+  # 撮影とプレビュー画像の転送に決まった時間がかかるカメラです。
+  # 撮影は1枚ずつしかできませんが、転送は撮影と並行して行います。(実機と同じ)
+  class SimulatedCaptureCamera
+    attr_accessor :captureDelay, :transferDelay, :scheduler, :values
+    attr_reader :propertyCache, :captured, :writes
+    def initialize(captureDelay, transferDelay)
+      @captureDelay = captureDelay
+      @transferDelay = transferDelay
+      @values = { 'EXPREV' => '<EXPREV/0.0>' }
+      @captured = []
+      @writes = 0
+      @captureQueue = Dispatch::Queue.new("SimulatedCaptureCamera.capture")
+      @transferQueue = Dispatch::Queue.new("SimulatedCaptureCamera.transfer")
+      @propertyCache = CameraPropertyCache.new(self)
+    end
+    def cameraPropertyValues(names, error:error)
+      result = {}
+      names.allObjects.each { |name| result[name] = @values[name] if @values[name] }
+      result
+    end
+    def cameraPropertyValue(name, error:error)
+      @values[name]
+    end
+    def setCameraPropertyValues(values, error:error)
+      @writes += 1
+      @values.merge!(values)
+      true
+    end
+    def takePicture(options, progressHandler:progressHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+      @captureQueue.async {
+        sleep(@captureDelay)
+        number = @captured.size
+        @captured << { exposure: @values['EXPREV'], capturedAt: CACurrentMediaTime() }
+        completionHandler.call({}) if completionHandler
+        # 撮影が終わってから、カメラキットがプレビュー画像を受信します。
+        @transferQueue.async {
+          sleep(@transferDelay)
+          @scheduler.receiveCapturedImage("jpeg#{number}", {}) if @scheduler
+        }
+      }
+    end
+  end
+
+  def schedulerWith(camera)
+    scheduler = CaptureScheduler.new(camera)
+    camera.scheduler = scheduler
+    scheduler
+  end
+
+  def run(scheduler, plan)
+    finished = nil
+    scheduler.start(plan, progressHandler:nil, completionHandler:->(stats) { finished = stats }, errorHandler:nil).should == true
+    scheduler.waitUntilTransferred(30.0).should == true
+    finished.should.not == nil
+    scheduler.statistics
+  end
+
+  it "converts exposure compensation in thirds of a stop" do
+    CaptureScheduler.exposureValueOf(0).should == '<EXPREV/0.0>'
+    CaptureScheduler.exposureValueOf(-1).should == '<EXPREV/-0.3>'
+    CaptureScheduler.exposureValueOf(5).should == '<EXPREV/+1.7>'
+    CaptureScheduler.exposureValueOf(99).should == '<EXPREV/+5.0>'
+    [-15, -4, 0, 2, 3, 13].each { |thirds| CaptureScheduler.thirdsOf(CaptureScheduler.exposureValueOf(thirds)).should == thirds }
+    CaptureScheduler.bracketOf(5, 3).should == [0, -3, 3, -6, 6]
+  end
+
+  it "fires on an absolute timeline while previews are still arriving" do
+    camera = SimulatedCaptureCamera.new(0.03, 0.08)
+    scheduler = schedulerWith(camera)
+    saved = []
+    scheduler.imageHandler = ->(data, metadata, shot) { saved << [data, shot[:tick]] }
+    stats = run(scheduler, CaptureScheduler.plan(10, 0.1))
+    stats[:shots].should == 10
+    stats[:skippedTicks].should == 0
+    stats[:transfers].should == 10
+    saved.map { |data, tick| tick }.should == (0...10).to_a
+    saved.last[0].should == 'jpeg9'
+    # マシンの負荷で揺れるので、予定の間隔に対する割合で確かめます。
+    interval = 0.1
+    stats[:drift].abs.should < interval * 0.3
+    stats[:jitterMax].should < interval * 0.3
+    (stats[:shotsPerMinute] / (60.0 / interval) - 1.0).abs.should < 0.1
+  end
+
+  it "takes the bracketing sequence from the current exposure and restores it" do
+    camera = SimulatedCaptureCamera.new(0.01, 0.02)
+    camera.values['EXPREV'] = '<EXPREV/+0.3>'
+    scheduler = schedulerWith(camera)
+    stats = run(scheduler, CaptureScheduler.plan(2, 0.1, CaptureScheduler.bracketOf(3, 3)))
+    expected = ['<EXPREV/+0.3>', '<EXPREV/-0.7>', '<EXPREV/+1.3>']
+    camera.captured.map { |shot| shot[:exposure] }.should == expected + expected
+    stats[:exposures].should == expected + expected
+    camera.values['EXPREV'].should == '<EXPREV/+0.3>'
+  end
+
+  it "skips a tick instead of drifting when a shot overruns" do
+    camera = SimulatedCaptureCamera.new(0.12, 0.01)
+    scheduler = schedulerWith(camera)
+    stats = run(scheduler, CaptureScheduler.plan(5, 0.05))
+    stats[:skippedTicks].should > 0
+    (stats[:ticks] + stats[:skippedTicks]).should == 5
+    stats[:shots].should == stats[:ticks]
+  end
+
+  it "does not wait for previews when RECVIEW is off" do
+    camera = SimulatedCaptureCamera.new(0.01, 0.01)
+    camera.values['RECVIEW'] = '<RECVIEW/OFF>'
+    scheduler = schedulerWith(camera)
+    # プレビュー画像は届きません。
+    camera.scheduler = nil
+    startTime = CACurrentMediaTime()
+    stats = run(scheduler, CaptureScheduler.plan(3, 0.05))
+    stats[:shots].should == 3
+    stats[:transfers].should == 0
+    (CACurrentMediaTime() - startTime).should < CaptureScheduler::PREVIEW_GRACE
+  end
+
+  it "gives up on previews that never arrive" do
+    camera = SimulatedCaptureCamera.new(0.01, 0.01)
+    scheduler = schedulerWith(camera)
+    camera.scheduler = nil
+    stats = run(scheduler, CaptureScheduler.plan(2, 0.05))
+    stats[:shots].should == 2
+    # 次の撮影計画の画像が、前の撮影のものとして保存されることはありません。
+    saved = []
+    scheduler.imageHandler = ->(data, metadata, shot) { saved << shot[:tick] }
+    camera.scheduler = scheduler
+    run(scheduler, CaptureScheduler.plan(1, 0.05))
+    saved.should == [0]
+  end
+
+  it "does not save a late preview of the previous plan under the next plan" do
+    camera = SimulatedCaptureCamera.new(0.01, 0.3)
+    scheduler = schedulerWith(camera)
+    saved = []
+    scheduler.imageHandler = ->(data, metadata, shot) { saved << [data, shot[:tick]] }
+    scheduler.start(CaptureScheduler.plan(1, 0.0), progressHandler:nil, completionHandler:nil, errorHandler:nil).should == true
+    sleep(0.005) while scheduler.running
+    # 前の撮影のプレビュー画像が届く前に、次の撮影計画を始めます。
+    camera.transferDelay = 0.01
+    saved.clear
+    stats = run(scheduler, CaptureScheduler.plan(2, 0.05))
+    stats[:shots].should == 2
+    saved.should == [['jpeg1', 0], ['jpeg2', 1]]
+  end
+
+  it "stops after the shot in progress" do
+    camera = SimulatedCaptureCamera.new(0.02, 0.01)
+    camera.values['EXPREV'] = '<EXPREV/-1.0>'
+    scheduler = schedulerWith(camera)
+    finished = nil
+    scheduler.start(CaptureScheduler.plan(100, 0.05, [0, 3]), progressHandler:nil, completionHandler:->(stats) { finished = stats }, errorHandler:nil)
+    sleep(0.2)
+    scheduler.stop
+    scheduler.waitUntilTransferred(5.0).should == true
+    scheduler.running.should == false
+    finished.should.not == nil
+    finished[:shots].should < 20
+    camera.values['EXPREV'].should == '<EXPREV/-1.0>'
+  end
+
+  # 1回に0.04秒撮影して0.09秒転送するカメラで、0.1秒間隔で12回撮る場合の比較です。
+  it "keeps the interval where waiting for each transfer drifts" do
+    count = 12
+    interval = 0.1
+
+    # これまでのやり方: 撮影と転送を待ってから、次の撮影まで間隔だけ待ちます。
+    naive = SimulatedCaptureCamera.new(0.04, 0.09)
+    naiveScheduler = CaptureScheduler.new(naive)
+    received = Dispatch::Semaphore.new(0)
+    naive.scheduler = Object.new.tap { |receiver| receiver.define_singleton_method(:receiveCapturedImage) { |data, metadata| received.signal } }
+    startTime = CACurrentMediaTime()
+    triggers = count.times.map do |k|
+      triggeredAt = CACurrentMediaTime()
+      captured = Dispatch::Semaphore.new(0)
+      naive.takePicture(nil, progressHandler:nil, completionHandler:->(info) { captured.signal }, errorHandler:nil)
+      captured.wait(5.0)
+      received.wait(5.0)
+      sleep(interval) if k < count - 1
+      triggeredAt
+    end
+    naiveDrift = triggers.last - (startTime + (count - 1) * interval)
+    naiveJitter = triggers.each_cons(2).map { |a, b| (b - a - interval).abs }.max
+    naiveRate = (count - 1) * 60.0 / (triggers.last - triggers.first)
+
+    camera = SimulatedCaptureCamera.new(0.04, 0.09)
+    scheduler = schedulerWith(camera)
+    stats = run(scheduler, CaptureScheduler.plan(count, interval))
+
+    puts "naive: drift=#{(naiveDrift * 1000).round}ms, jitter(max)=#{(naiveJitter * 1000).round}ms, #{naiveRate.round(1)}shots/min"
+    puts "scheduled: drift=#{(stats[:drift] * 1000).round(1)}ms, jitter(rms)=#{(stats[:jitterRms] * 1000).round(1)}ms, " +
+      "jitter(max)=#{(stats[:jitterMax] * 1000).round(1)}ms, #{stats[:shotsPerMinute].round(1)}shots/min, transfer(max)=#{(stats[:transferTimeMax] * 1000).round}ms"
+    stats[:shots].should == count
+    naiveDrift.should > 1.0
+    # 時刻はマシンの負荷で揺れるので、これまでのやり方や予定の間隔に対する割合で確かめます。
+    stats[:drift].abs.should < naiveDrift / 10
+    stats[:jitterMax].should < interval * 0.3
+    stats[:shotsPerMinute].should > naiveRate
+    # 予定どおりなら1分あたり600枚です。
+    (stats[:shotsPerMinute] / (60.0 / interval) - 1.0).abs.should < 0.1
+  end
+
+end
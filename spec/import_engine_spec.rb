@@ -0,0 +1,183 @@
+describe "ImportEngine" do
+
+  # 受信を求められたファイルの名前と位置を記録して、「jpeg」の4バイトのうち続きの分をすぐに返します。
+  class RecordingImportSource
+    attr_reader :fetched, :offsets
+    def initialize
+      @fetched = []
+      @offsets = []
+    end
+    def fetchContent(content, offset:offset, chunkHandler:chunkHandler, completionHandler:completionHandler, errorHandler:errorHandler)
+      @fetched << content[OLYCameraContentListFilenameKey]
+      @offsets << offset
+      chunkHandler.call(NSData.dataWithBytes('jpeg'[offset..-1], length:4 - offset))
+      completionHandler.call
+    end
+  end
+
+  def contentsNamed(names)
+    names.map do |name|
+      {
+        OLYCameraContentListDirectoryKey => '/DCIM/100OLYMP',
+        OLYCameraContentListFilenameKey => name,
+        OLYCameraContentListFilesizeKey => 4
+      }
+    end
+  end
+
+  def importAll(engine, contents)
+    statistics = nil
+    engine.completionHandler = ->(result) { statistics = result }
+    engine.import(contents)
+    NSRunLoop.currentRunLoop.runUntilDate(NSDate.dateWithTimeIntervalSinceNow(0.1)) while !statistics
+    statistics
+  end
+
+  def writeLocalFile(name, string)
+    string.dataUsingEncoding(NSUTF8StringEncoding).writeToFile(@directory.stringByAppendingPathComponent(name), atomically:true)
+  end
+
+  before do
+    @directory = NSTemporaryDirectory().stringByAppendingPathComponent("ImportEngineSpec-#{NSUUID.UUID.UUIDString}")
+    NSFileManager.defaultManager.createDirectoryAtPath(@directory, withIntermediateDirectories:true, attributes:nil, error:nil)
+  end
+
+  after do
+    NSFileManager.defaultManager.removeItemAtPath(@directory, error:nil)
+  end
+
+  it "makes the receiver wait while every buffer is being written" do
+    pool = ImportChunkPool.new(2, 1024)
+    first = pool.checkout
+    pool.checkout
+    checkedOut = false
+    Dispatch::Queue.concurrent.async {
+      pool.checkout
+      checkedOut = true
+    }
+    sleep(0.1)
+    checkedOut.should == false
+    pool.checkin(first)
+    sleep(0.1)
+    checkedOut.should == true
+    pool.bytesReserved.should == 2048
+  end
+
+  it "restarts a file from zero when its size changed on the camera" do
+    path = @directory.stringByAppendingPathComponent('journal.plist')
+    journal = ImportJournal.new(path)
+    journal.entryFor('/DCIM/100OLYMP/P0000001.ORF', size:1000)
+    journal.updateBytes(600, forPath:'/DCIM/100OLYMP/P0000001.ORF')
+    journal.save(true)
+    reopened = ImportJournal.new(path)
+    reopened.entryFor('/DCIM/100OLYMP/P0000001.ORF', size:1000)['bytes'].should == 600
+    reopened.entryFor('/DCIM/100OLYMP/P0000001.ORF', size:2000)['bytes'].should == 0
+  end
+
+  it "only saves the files that were downloaded but not saved when resuming" do
+    contents = contentsNamed(%w(P0000001.JPG P0000002.JPG P0000003.JPG))
+    paths = contents.map { |content| "/DCIM/100OLYMP/#{content[OLYCameraContentListFilenameKey]}" }
+    # 1つ目は保存まで済んでいて、2つ目は受信し終えたところで中断した前回の記録です。
+    journal = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+    paths.first(2).each do |path|
+      journal.entryFor(path, size:4)
+      journal.updateBytes(4, forPath:path)
+      journal.markDownloaded(path, sha256:'')
+    end
+    journal.markSaved(paths[0])
+    writeLocalFile('P0000002.JPG', 'jpeg')
+
+    # 3つ目だけを受信するはずです。
+    source = RecordingImportSource.new
+    engine = ImportEngine.new(source, @directory)
+    engine.saveToLibrary = false
+    progressed = []
+    engine.progressHandler = ->(content, result) { progressed << content[OLYCameraContentListFilenameKey] }
+    statistics = importAll(engine, contents)
+
+    source.fetched.should == ['P0000003.JPG']
+    progressed.should == ['P0000002.JPG', 'P0000003.JPG']
+    statistics[:failedFiles].should == 0
+    reopened = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+    paths.each { |path| reopened.entryFor(path, size:4)['state'].should == 'saved' }
+  end
+
+  it "downloads again from zero when the file on disk is missing or shorter than the journal" do
+    contents = contentsNamed(%w(P0000001.JPG P0000002.JPG P0000003.JPG P0000004.JPG))
+    paths = contents.map { |content| "/DCIM/100OLYMP/#{content[OLYCameraContentListFilenameKey]}" }
+    journal = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+    paths.each { |path| journal.entryFor(path, size:4) }
+    # 1つ目は受信し終えたファイルが消えていて、2つ目と3つ目は途中までのファイルが短いか消えています。
+    journal.updateBytes(4, forPath:paths[0])
+    journal.markDownloaded(paths[0], sha256:'')
+    journal.updateBytes(2, forPath:paths[1])
+    writeLocalFile('P0000002.JPG', 'j')
+    journal.updateBytes(2, forPath:paths[2])
+    # 4つ目は記録どおり途中まで受信してあるので、続きから受信します。
+    journal.updateBytes(2, forPath:paths[3])
+    writeLocalFile('P0000004.JPG', 'jp')
+    journal.save(true)
+
+    source = RecordingImportSource.new
+    engine = ImportEngine.new(source, @directory)
+    engine.saveToLibrary = false
+    statistics = importAll(engine, contents)
+
+    source.fetched.should == %w(P0000001.JPG P0000002.JPG P0000003.JPG P0000004.JPG)
+    source.offsets.should == [0, 0, 0, 2]
+    statistics[:failedFiles].should == 0
+    hasher = ImportHasher.new
+    hasher.update('jpeg'.dataUsingEncoding(NSUTF8StringEncoding))
+    sha256 = hasher.hexdigest
+    reopened = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+    contents.each_with_index do |content, i|
+      NSString.stringWithContentsOfFile(@directory.stringByAppendingPathComponent(content[OLYCameraContentListFilenameKey]), encoding:NSUTF8StringEncoding, error:nil).should == 'jpeg'
+      reopened.entryFor(paths[i], size:4)['sha256'].should == sha256
+    end
+  end
+
+  # tools/camera_stand_in.rb --raw を起動して、.envにCAMERA_STAND_IN_URLを書いておくと実行されます。
+  if App::ENV['CAMERA_STAND_IN_URL']
+    it "resumes interrupted RAW downloads without receiving them again" do
+      baseURL = App::ENV['CAMERA_STAND_IN_URL']
+      fetch = ->(path) { NSString.stringWithContentsOfURL(NSURL.URLWithString(baseURL + path), encoding:NSUTF8StringEncoding, error:nil) }
+      sema = Dispatch::Semaphore.new(0)
+      contents = nil
+      PlaybackHttpFetcher.new(baseURL).downloadContentList { |list| contents = list; sema.signal }
+      sema.wait
+      contents = contents.select { |content| content[OLYCameraContentListFilenameKey].end_with?('.ORF') }.first(5)
+      contents.size.should == 5
+      totalBytes = contents.inject(0) { |sum, content| sum + content[OLYCameraContentListFilesizeKey].to_i }
+
+      # 3MBごとに接続を切られる、遅いWi-Fiを真似ます。
+      fetch.call('control?bandwidth=8000000&disconnect_every=3000000')
+      engine = ImportEngine.new(ImportHttpSource.new(baseURL), @directory)
+      engine.saveToLibrary = false
+      statistics = nil
+      engine.completionHandler = ->(result) { statistics = result; sema.signal }
+      engine.import(contents)
+      # MARK: 完了はメインキューに届くので、ランループを回しながら待ちます。
+      NSRunLoop.currentRunLoop.runUntilDate(NSDate.dateWithTimeIntervalSinceNow(0.1)) while !statistics
+      fetch.call('control?bandwidth=0&disconnect_every=0')
+
+      puts "import #{contents.size} RAW files: #{'%.1f' % statistics[:megabytesPerSecond]}MB/s, " +
+        "resumes=#{statistics[:resumes]}, received=#{statistics[:bytesReceived]}/#{totalBytes}, " +
+        "peakRSS=#{statistics[:peakResidentBytes] / (1024 * 1024)}MB, buffers=#{statistics[:bufferBytes] / 1024}KB"
+      statistics[:files].should == contents.size
+      statistics[:failedFiles].should == 0
+      statistics[:resumes].should > 0
+      statistics[:bytesWritten].should == totalBytes
+      # 切断されるたびに最初から受信し直していたら、この何倍にもなります。
+      statistics[:bytesReceived].should < totalBytes * 1.5
+
+      journal = ImportJournal.new(@directory.stringByAppendingPathComponent('journal.plist'))
+      contents.each do |content|
+        path = "#{content[OLYCameraContentListDirectoryKey]}/#{content[OLYCameraContentListFilenameKey]}"
+        entry = journal.entryFor(path, size:content[OLYCameraContentListFilesizeKey].to_i)
+        entry['state'].should == 'saved'
+        entry['sha256'].should == fetch.call("sha256?DIR=#{path}")
+      end
+    end
+  end
+
+end
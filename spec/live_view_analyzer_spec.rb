@@ -0,0 +1,125 @@
+describe "LiveViewAnalyzer" do
+
+  # 上半分がグラデーション、下半分が白と黒の細かい市松模様の画像です。
+  def testImage(size)
+    UIGraphicsBeginImageContextWithOptions(size, true, 1.0)
+    (0...size.width.to_i).step(8) do |x|
+      UIColor.colorWithWhite(x / size.width, alpha:1.0).setFill
+      UIRectFill(CGRectMake(x, 0, 8, size.height / 2))
+    end
+    UIColor.blackColor.setFill
+    UIRectFill(CGRectMake(0, size.height / 2, size.width, size.height / 2))
+    UIColor.whiteColor.setFill
+    (0...size.width.to_i).step(4) do |x|
+      (size.height.to_i / 2...size.height.to_i).step(4) do |y|
+        UIRectFill(CGRectMake(x, y, 2, 2)) if (x / 4 + y / 4).even?
+      end
+    end
+    image = UIGraphicsGetImageFromCurrentImageContext()
+    UIGraphicsEndImageContext()
+    image
+  end
+
+  # 画像をLiveViewAnalysisが読めるR,G,B,Xのビットマップにします。
+  def bitmapOf(image)
+    width = CGImageGetWidth(image.CGImage)
+    height = CGImageGetHeight(image.CGImage)
+    bitmap = CGBitmapContextCreate(nil, width, height, 8, width * 4, CGColorSpaceCreateDeviceRGB(), KCGImageAlphaNoneSkipLast | KCGBitmapByteOrder32Big)
+    CGContextDrawImage(bitmap, CGRectMake(0, 0, width, height), image.CGImage)
+    bitmap
+  end
+
+  def buffersOf(bitmap, width, height)
+    peaking = NSMutableData.dataWithLength(width * height)
+    zebra = NSMutableData.dataWithLength(width * height)
+    {
+      pixels: CGBitmapContextGetData(bitmap).cast!('C'),
+      histogram: Pointer.new('I', 1024),
+      peaking: peaking,
+      zebra: zebra,
+      peakingBytes: peaking.mutableBytes.cast!('C'),
+      zebraBytes: zebra.mutableBytes.cast!('C')
+    }
+  end
+
+  def runKernel(simd, context, buffers, width)
+    if simd
+      LVAAnalyze(context, buffers[:pixels], width * 4, buffers[:histogram], buffers[:peakingBytes], buffers[:zebraBytes], 48, 242, 0)
+    else
+      LVAAnalyzeScalar(context, buffers[:pixels], width * 4, buffers[:histogram], buffers[:peakingBytes], buffers[:zebraBytes], 48, 242, 0)
+    end
+  end
+
+  def resultOf(simd, context, bitmap, width, height)
+    buffers = buffersOf(bitmap, width, height)
+    marked = runKernel(simd, context, buffers, width)
+    [marked, (0...1024).map { |i| buffers[:histogram][i] }, buffers[:peaking], buffers[:zebra]]
+  end
+
+  it "gives the same result with and without SIMD" do
+    [[640, 480], [101, 37]].each do |width, height|
+      bitmap = bitmapOf(testImage(CGSizeMake(width, height)))
+      context = LVAContextCreate(width, height)
+      simd = resultOf(true, context, bitmap, width, height)
+      scalar = resultOf(false, context, bitmap, width, height)
+      LVAContextRelease(context)
+      simd[0].should == scalar[0]
+      simd[1].should == scalar[1]
+      simd[2].isEqualToData(scalar[2]).should == true
+      simd[3].isEqualToData(scalar[3]).should == true
+    end
+  end
+
+  it "counts every pixel in each histogram channel" do
+    analysis = LiveViewAnalyzer.new.analyze(testImage(CGSizeMake(640, 480)))
+    LiveViewAnalyzer::HISTOGRAM_CHANNELS.each do |channel|
+      analysis[:histogram][channel].inject(0) { |sum, count| sum + count }.should == 640 * 480
+    end
+    analysis[:image].size.should == CGSizeMake(640, 480)
+  end
+
+  it "marks edges for peaking and bright areas for zebra" do
+    analyzer = LiveViewAnalyzer.new
+    analysis = analyzer.analyze(testImage(CGSizeMake(640, 480)))
+    # 市松模様の下半分には輪郭がたくさんあり、なだらかな上半分にはほとんどありません。
+    analysis[:peakingPixels].should > 640 * 240 / 4
+    analysis[:peakingPixels].should < 640 * 240
+    CGImageGetWidth(analysis[:zebraMask]).should == 640
+    analyzer.zebraEnabled = false
+    analyzer.analyze(testImage(CGSizeMake(640, 480)))[:zebraMask].should == nil
+  end
+
+  # ライブビューのサイズごとの1ピクセルあたりの処理時間です。
+  it "reports nanoseconds per pixel at each live view size" do
+    analyzer = LiveViewAnalyzer.new
+    LiveViewSizeController::SIZES.each do |size|
+      width = size.width.to_i
+      height = size.height.to_i
+      image = testImage(CGSizeMake(width, height))
+      bitmap = bitmapOf(image)
+      context = LVAContextCreate(width, height)
+      buffers = buffersOf(bitmap, width, height)
+      results = {}
+      [true, false].each do |simd|
+        runKernel(simd, context, buffers, width)
+        startTime = CACurrentMediaTime()
+        20.times { runKernel(simd, context, buffers, width) }
+        results[simd] = (CACurrentMediaTime() - startTime) / 20
+      end
+      LVAContextRelease(context)
+      # 展開から解析結果の画像を作るまで、ワーカーで実際に行う処理全体です。
+      analyzer.analyze(image)
+      startTime = CACurrentMediaTime()
+      20.times { analyzer.analyze(image) }
+      total = (CACurrentMediaTime() - startTime) / 20
+      pixels = width * height
+      puts "#{width}x#{height}: #{analyzer.kernelName} #{(results[true] * 1e9 / pixels).round(2)}ns/px, " +
+        "scalar #{(results[false] * 1e9 / pixels).round(2)}ns/px, " +
+        "analyze #{(total * 1000).round(2)}ms/frame"
+      # 30fpsのフレーム間隔に収まらなければ、フレームを落とすことになります。
+      total.should < LiveViewSizeController::TARGET_FRAME_INTERVAL
+    end
+    analyzer.purge
+  end
+
+end
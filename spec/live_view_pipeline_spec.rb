@@ -0,0 +1,88 @@
+describe "LiveViewPipeline" do
+
+  # 録画したライブビューの代わりに、指定サイズのJPEGフレーム列を作ります。
+  def recordedFrames(size, count)
+    (0...count).map do |index|
+      UIGraphicsBeginImageContextWithOptions(size, true, 1.0)
+      UIColor.colorWithHue((index % 30) / 30.0, saturation:0.5, brightness:0.8, alpha:1.0).setFill
+      UIRectFill(CGRectMake(0, 0, size.width, size.height))
+      UIColor.whiteColor.setFill
+      UIRectFill(CGRectMake(index * 8 % size.width, 0, 32, size.height))
+      image = UIGraphicsGetImageFromCurrentImageContext()
+      UIGraphicsEndImageContext()
+      UIImageJPEGRepresentation(image, 0.7)
+    end
+  end
+
+  # フレームを一定間隔で流し込み、表示されたフレームの番号を記録します。
+  def replay(frames, interval, pipeline)
+    presented = []
+    pipeline.presentQueue = Dispatch::Queue.new("LiveViewPipelineSpec.present")
+    pipeline.observer = ->(frame) { presented << frame[:sequence] }
+    frames.each do |data|
+      pipeline.receive(data, { 'Orientation' => 1 })
+      sleep(interval)
+    end
+    sleep(0.5)
+    presented
+  end
+
+  before do
+    @decoder = ->(data, metadata) { UIImage.imageWithData(data) }
+  end
+
+  it "presents frames in order and never goes back to an older one" do
+    pipeline = LiveViewPipeline.new
+    pipeline.decoder = @decoder
+    presented = replay(recordedFrames(CGSizeMake(640, 480), 60), 1.0 / 30, pipeline)
+    presented.should == presented.sort
+    presented.uniq.size.should == presented.size
+    presented.last.should == 60
+  end
+
+  it "drops stale frames before decoding when the decoder is slower than the stream" do
+    pipeline = LiveViewPipeline.new(1)
+    pipeline.decoder = ->(data, metadata) { sleep(0.1); UIImage.imageWithData(data) }
+    replay(recordedFrames(CGSizeMake(640, 480), 30), 1.0 / 30, pipeline)
+    stats = pipeline.statistics
+    stats[:received].should == 30
+    stats[:droppedBeforeDecode].should > 0
+    (stats[:decoded] + stats[:droppedBeforeDecode]).should == 30
+    stats[:presented].should == stats[:decoded] - stats[:droppedAfterDecode]
+  end
+
+  it "keeps decoding after the decoder raises" do
+    pipeline = LiveViewPipeline.new
+    failures = 0
+    pipeline.decoder = ->(data, metadata) {
+      if failures < LiveViewPipeline::DEFAULT_WORKERS + 1
+        failures += 1
+        raise "broken frame"
+      end
+      UIImage.imageWithData(data)
+    }
+    presented = replay(recordedFrames(CGSizeMake(640, 480), 10), 1.0 / 30, pipeline)
+    stats = pipeline.statistics
+    (stats[:decoded] + stats[:droppedBeforeDecode]).should == 10
+    stats[:presented].should > 0
+    presented.last.should == 10
+  end
+
+  it "reports receive to present latency at each live view size" do
+    [
+      ['VGA', CGSizeMake(640, 480)],
+      ['XGA', CGSizeMake(1024, 768)],
+      ['QuadVGA', CGSizeMake(1280, 960)]
+    ].each do |name, size|
+      pipeline = LiveViewPipeline.new
+      pipeline.decoder = @decoder
+      replay(recordedFrames(size, 90), 1.0 / 30, pipeline)
+      stats = pipeline.statistics
+      puts "#{name}: presented=#{stats[:presented]}/#{stats[:received]}, dropped=#{stats[:droppedBeforeDecode]}+#{stats[:droppedAfterDecode]}, " +
+        "receive->decode p50=#{(stats[:receiveToDecode][:p50] * 1000).round(2)}ms, " +
+        "receive->present p50=#{(stats[:receiveToPresent][:p50] * 1000).round(2)}ms p95=#{(stats[:receiveToPresent][:p95] * 1000).round(2)}ms"
+      stats[:presented].should > 0
+    end
+  end
+
+end
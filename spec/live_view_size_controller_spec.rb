@@ -0,0 +1,94 @@
+describe "LiveViewSizeController" do
+
+  # 通信路の帯域(byte/s)ごとの区間から、ライブビューの到着トレースを再生します。
+  # ペイロードは画素数に比例し、デコード時間はVGAで4msとします。
+  # サイズの変更はカメラに書き込めたものとして確定させます。
+  def replay(controller, segments)
+    random = Random.new(1)
+    time = 0.0
+    sizes = []
+    segments.each do |duration, bandwidth|
+      finish = time + duration
+      while time < finish
+        size = controller.currentSize
+        pixels = size.width * size.height
+        bytes = (pixels / 10).to_i
+        time += [1.0 / 30, bytes / bandwidth.to_f].max + random.rand * 0.004
+        controller.observeDecode(0.004 * pixels / (640 * 480))
+        size = controller.observeArrival(time, bytes)
+        controller.commit(size) if size
+        sizes << [time, controller.index]
+      end
+    end
+    sizes
+  end
+
+  def indexAt(sizes, time)
+    sizes.reverse.find { |t, index| t <= time }[1]
+  end
+
+  before do
+    @controller = LiveViewSizeController.new
+    @controller.commit(@controller.reset(AppCamera::LIVE_VIEW_SIZES[:normal]))
+  end
+
+  it "steps up on a clean link and down on a busy one" do
+    sizes = replay(@controller, [[60, 3_000_000], [40, 700_000], [60, 3_000_000]])
+    # 空いている時はXGA以上、混んでいる時はQVGAに落ち着きます。
+    indexAt(sizes, 55).should >= 3
+    indexAt(sizes, 95).should == 0
+    indexAt(sizes, 159).should >= 3
+    puts "switches=#{@controller.switches.size} " + @controller.switches.map { |s| "#{s[:time].round(1)}s:#{s[:from]}->#{s[:to]}" }.join(' ')
+  end
+
+  it "does not flap between sizes" do
+    replay(@controller, [[160, 3_000_000]])
+    @controller.switches.size.should <= 12
+    ups = @controller.switches.select { |s| s[:to] > s[:from] }
+    ups.each_cons(2) do |a, b|
+      (b[:time] - a[:time]).should >= LiveViewSizeController::MIN_DWELL
+    end
+    # 帯域に収まらないQuadVGAへの再挑戦は、だんだん間隔が空いていきます。
+    probes = ups.select { |s| s[:to] == 4 }.map { |s| s[:time] }
+    gaps = probes.each_cons(2).map { |a, b| b - a }
+    gaps.should == gaps.sort
+  end
+
+  it "keeps the floor while magnifying and restores the previous size afterwards" do
+    @controller.startMagnifying(AppCamera::LIVE_VIEW_SIZES[:magnify]).should == OLYCameraLiveViewSizeXGA
+    @controller.commit(OLYCameraLiveViewSizeXGA).should == true
+    replay(@controller, [[30, 700_000]])
+    @controller.currentSize.should == OLYCameraLiveViewSizeXGA
+    @controller.stopMagnifying.should == OLYCameraLiveViewSizeVGA
+  end
+
+  it "keeps the current size until the camera accepts the new one" do
+    @controller.startMagnifying(AppCamera::LIVE_VIEW_SIZES[:magnify]).should == OLYCameraLiveViewSizeXGA
+    @controller.reject(OLYCameraLiveViewSizeXGA).should == true
+    @controller.currentSize.should == OLYCameraLiveViewSizeVGA
+    # 書き込めなかった変更は、後から確定させることはできません。
+    @controller.commit(OLYCameraLiveViewSizeXGA).should == false
+    @controller.currentSize.should == OLYCameraLiveViewSizeVGA
+    @controller.switches.should == []
+  end
+
+  it "raises the size to the floor after the camera rejected it" do
+    @controller.startMagnifying(AppCamera::LIVE_VIEW_SIZES[:magnify]).should == OLYCameraLiveViewSizeXGA
+    @controller.reject(OLYCameraLiveViewSizeXGA).should == true
+    replay(@controller, [[2, 3_000_000]])
+    @controller.currentSize.should == OLYCameraLiveViewSizeXGA
+    @controller.switches.first[:reason].should == 'floor'
+  end
+
+  it "drops the magnifying floor when reset" do
+    @controller.commit(@controller.startMagnifying(AppCamera::LIVE_VIEW_SIZES[:magnify])).should == true
+    # 拡大ビューのまま撮影画面を抜けて、また入ったことにします。
+    @controller.reset(AppCamera::LIVE_VIEW_SIZES[:normal]).should == OLYCameraLiveViewSizeVGA
+    @controller.commit(OLYCameraLiveViewSizeVGA).should == true
+    @controller.floorIndex.should == 0
+    replay(@controller, [[30, 700_000]])
+    @controller.currentSize.should.not == OLYCameraLiveViewSizeXGA
+    @controller.startMagnifying(AppCamera::LIVE_VIEW_SIZES[:magnify]).should.not == nil
+  end
+
+end
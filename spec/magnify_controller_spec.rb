@@ -0,0 +1,216 @@
+describe "MagnifyController" do
+
+  # コマンドごとに決まった時間待たされる、拡大ビューだけを真似たカメラです。
+  # 実際の表示範囲(trueRect)はカメラだけが知っていて、手元ではAppCameraと同じように計算します。
+  class SlowMagnifyingCamera
+    include MagnifyingAreaConcern
+    attr_accessor :latency, :trueScrollStep
+    attr_reader :magnifyingLiveView, :trueRect, :roundTrips
+    def initialize(latency, trueScrollStep = 1.0)
+      @latency = latency
+      # 1回の表示範囲移動で実際に動く量です。(表示範囲の大きさに対する割合)
+      @trueScrollStep = trueScrollStep
+      @magnifyingLiveView = false
+      @trueRect = CGRectZero
+      @roundTrips = 0
+      resetMagnifyingArea(true)
+    end
+    def startMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
+      roundTrip
+      return false if @magnifyingLiveView
+      @magnifyingLiveView = true
+      size = 1.0 / MAGNIFYING_FACTORS[scale]
+      @trueRect = clampMagnifyingDisplayArea(CGRectMake(point.x - size / 2, point.y - size / 2, size, size))
+      trackMagnifyingStart(point, scale)
+      true
+    end
+    def restartMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
+      return false if @magnifyingLiveView && !stopMagnifyingLiveView(error)
+      startMagnifyingLiveViewAtPoint(point, scale:scale, error:error)
+    end
+    def stopMagnifyingLiveView(error)
+      roundTrip
+      return false unless @magnifyingLiveView
+      @magnifyingLiveView = false
+      resetMagnifyingArea
+      true
+    end
+    def changeMagnifyingLiveViewScale(scale, error:error)
+      roundTrip
+      return false unless @magnifyingLiveView
+      size = 1.0 / MAGNIFYING_FACTORS[scale]
+      @trueRect = clampMagnifyingDisplayArea(CGRectMake(CGRectGetMidX(@trueRect) - size / 2, CGRectGetMidY(@trueRect) - size / 2, size, size))
+      trackMagnifyingScale(scale)
+      true
+    end
+    def changeMagnifyingLiveViewArea(direction, error:error)
+      roundTrip
+      return false unless @magnifyingLiveView
+      dx = @trueRect.size.width * @trueScrollStep
+      dy = @trueRect.size.height * @trueScrollStep
+      origin = case direction
+      when OLYCameraMagnifyingLiveViewScrollDirectionUp    then [@trueRect.origin.x, @trueRect.origin.y - dy]
+      when OLYCameraMagnifyingLiveViewScrollDirectionDown  then [@trueRect.origin.x, @trueRect.origin.y + dy]
+      when OLYCameraMagnifyingLiveViewScrollDirectionLeft  then [@trueRect.origin.x - dx, @trueRect.origin.y]
+      when OLYCameraMagnifyingLiveViewScrollDirectionRight then [@trueRect.origin.x + dx, @trueRect.origin.y]
+      end
+      @trueRect = clampMagnifyingDisplayArea(CGRectMake(origin[0], origin[1], @trueRect.size.width, @trueRect.size.height))
+      trackMagnifyingScroll(direction)
+      true
+    end
+    def magnifyingLiveViewArea(error)
+      roundTrip
+      return nil unless @magnifyingLiveView
+      {
+        OLYCameraMagnifyingOverallViewSizeKey => NSValue.valueWithCGSize(CGSizeMake(4608, 3456)),
+        OLYCameraMagnifyingDisplayAreaRectKey => NSValue.valueWithCGRect(@trueRect)
+      }
+    end
+    def syncMagnifyingLiveViewArea(error)
+      trackMagnifyingArea(magnifyingLiveViewArea(error))
+    end
+    def roundTrip
+      @roundTrips += 1
+      sleep(@latency)
+    end
+  end
+
+  def centerOf(rect)
+    CGPointMake(CGRectGetMidX(rect), CGRectGetMidY(rect))
+  end
+
+  # 指で少しずつなぞった時のように、短い間隔で移動を要求します。
+  def drag(controller, total, events, interval)
+    events.times do
+      controller.scrollBy(total.x / events, total.y / events)
+      sleep(interval)
+    end
+  end
+
+  def startedController(camera, scale = OLYCameraMagnifyingLiveViewScaleX5, point = CGPointMake(0.5, 0.5))
+    controller = MagnifyController.new(camera)
+    controller.start(point, scale)
+    controller.waitUntilSettled(5.0).should == true
+    controller.resetStatistics
+    controller
+  end
+
+  it "coalesces a burst of scrolls into a few commands" do
+    camera = SlowMagnifyingCamera.new(0.05)
+    controller = startedController(camera)
+    drag(controller, CGPointMake(0.2, 0.0), 40, 0.005)
+    target = centerOf(controller.targetRect)
+    controller.waitUntilSettled(5.0).should == true
+    stats = controller.statistics
+    stats[:requests].should == 40
+    stats[:commands].should < 10
+    # 最後は問い合わせた実際の表示範囲で確かめているので、1回の移動量の半分より近くにいます。
+    (CGRectGetMidX(camera.trueRect) - target.x).abs.should <= camera.trueRect.size.width / 2
+    camera.magnifyingDisplayAreaRect.should == camera.trueRect
+  end
+
+  it "magnifies again at the target instead of scrolling far" do
+    camera = SlowMagnifyingCamera.new(0.01)
+    controller = startedController(camera)
+    controller.scrollBy(0.3, -0.2)
+    controller.waitUntilSettled(5.0).should == true
+    stats = controller.statistics
+    stats[:commandsByType][:restart].should == 1
+    stats[:commandsByType][:scroll].should == 0
+    (CGRectGetMidX(camera.trueRect) - 0.8).abs.should < 0.01
+    (CGRectGetMidY(camera.trueRect) - 0.3).abs.should < 0.01
+  end
+
+  it "changes the scale in place and magnifies again when it also moves" do
+    camera = SlowMagnifyingCamera.new(0.01)
+    controller = startedController(camera)
+    controller.changeScale(OLYCameraMagnifyingLiveViewScaleX10)
+    controller.waitUntilSettled(5.0).should == true
+    controller.statistics[:commandsByType][:scale].should == 1
+    camera.trueRect.size.width.should.be.close 0.1, 0.0001
+    # 倍率と位置を一度に変える時は、まとめて拡大し直します。(ピンチした場所に寄る時など)
+    controller.resetStatistics
+    controller.start(CGPointMake(0.7, 0.5), OLYCameraMagnifyingLiveViewScaleX14)
+    controller.waitUntilSettled(5.0).should == true
+    controller.statistics[:commandsByType][:restart].should == 1
+    controller.statistics[:commandsByType][:scale].should == 0
+    (CGRectGetMidX(camera.trueRect) - 0.7).abs.should < 0.01
+  end
+
+  it "learns how far the camera scrolls in one step" do
+    camera = SlowMagnifyingCamera.new(0.005, 0.5)
+    controller = startedController(camera)
+    controller.scrollBy(0.2, 0.0)
+    controller.waitUntilSettled(5.0).should == true
+    controller.scrollBy(0.0, 0.2)
+    controller.waitUntilSettled(5.0).should == true
+    camera.magnifyingScrollStep.width.should.be.close 0.5, 0.0001
+    camera.magnifyingScrollStep.height.should.be.close 0.5, 0.0001
+    (CGRectGetMidY(camera.trueRect) - 0.7).abs.should <= camera.trueRect.size.height * 0.5 / 2
+  end
+
+  it "stops even if the magnification never reached the camera" do
+    camera = SlowMagnifyingCamera.new(0.02)
+    controller = MagnifyController.new(camera)
+    controller.start(CGPointMake(0.2, 0.2), OLYCameraMagnifyingLiveViewScaleX7)
+    controller.scrollBy(0.1, 0.1)
+    controller.stop
+    controller.waitUntilSettled(5.0).should == true
+    camera.magnifyingLiveView.should == false
+    controller.statistics[:commands].should <= 2
+  end
+
+  # 1回50msかかるカメラを14倍で拡大して大きくなぞった後に表示が落ち着くまでの時間を、1つずつコマンドを送るやり方と比べます。
+  it "settles faster than sending one command per request" do
+    latency = 0.05
+    interval = 0.008
+    events = 60
+    scale = OLYCameraMagnifyingLiveViewScaleX14
+    total = CGPointMake(0.4, 0.2)
+
+    # これまでのやり方: 1回分動いたら表示範囲移動と問い合わせを送り、順番に待ちます。
+    naive = SlowMagnifyingCamera.new(latency)
+    naive.startMagnifyingLiveViewAtPoint(CGPointMake(0.3, 0.3), scale:scale, error:nil)
+    queue = Dispatch::Queue.new("MagnifyControllerSpec.naive")
+    pending = CGPointMake(0.0, 0.0)
+    step = naive.trueRect.size.width
+    startTime = CACurrentMediaTime()
+    events.times do
+      pending.x += total.x / events
+      pending.y += total.y / events
+      while pending.x.abs >= step || pending.y.abs >= step
+        direction = pending.x.abs >= step ? OLYCameraMagnifyingLiveViewScrollDirectionRight : OLYCameraMagnifyingLiveViewScrollDirectionDown
+        pending.x -= step if direction == OLYCameraMagnifyingLiveViewScrollDirectionRight
+        pending.y -= step if direction == OLYCameraMagnifyingLiveViewScrollDirectionDown
+        queue.async {
+          naive.changeMagnifyingLiveViewArea(direction, error:nil)
+          naive.syncMagnifyingLiveViewArea(nil)
+        }
+      end
+      sleep(interval)
+    end
+    lastEventTime = CACurrentMediaTime()
+    queue.sync {}
+    naiveSettle = CACurrentMediaTime() - lastEventTime
+    naiveTime = CACurrentMediaTime() - startTime
+
+    camera = SlowMagnifyingCamera.new(latency)
+    controller = startedController(camera, scale, CGPointMake(0.3, 0.3))
+    startTime = CACurrentMediaTime()
+    drag(controller, total, events, interval)
+    lastEventTime = CACurrentMediaTime()
+    controller.waitUntilSettled(5.0).should == true
+    settle = CACurrentMediaTime() - lastEventTime
+    coalescedTime = CACurrentMediaTime() - startTime
+    stats = controller.statistics
+
+    puts "naive: #{naive.roundTrips - 1} round trips, settled #{(naiveSettle * 1000).round}ms after the last event (#{(naiveTime * 1000).round}ms total)"
+    puts "coalesced: #{stats[:commands]} round trips for #{stats[:requests]} requests #{stats[:commandsByType].inspect}, " +
+      "settled #{(settle * 1000).round}ms after the last event (#{(coalescedTime * 1000).round}ms total)"
+    stats[:commands].should < naive.roundTrips - 1
+    settle.should < naiveSettle
+    # 指を離してから、移動と確認の問い合わせの数回分で落ち着きます。
+    settle.should < latency * (MagnifyController::MAX_DIRECT_STEPS + 3)
+  end
+
+end
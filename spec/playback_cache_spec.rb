@@ -0,0 +1,97 @@
+describe "PlaybackCache" do
+
+  def contentAt(index)
+    {
+      OLYCameraContentListDirectoryKey => '/DCIM/100OLYMP',
+      OLYCameraContentListFilenameKey => "P#{'%07d' % index}.JPG",
+      OLYCameraContentListFilesizeKey => 4_000_000 + index,
+      OLYCameraContentListFiletypeKey => 'file',
+      OLYCameraContentListDatetimeKey => NSDate.dateWithTimeIntervalSince1970(1_443_657_600 + index * 2)
+    }
+  end
+
+  def blobOf(bytes)
+    NSMutableData.dataWithLength(bytes)
+  end
+
+  before do
+    @directory = NSTemporaryDirectory().stringByAppendingPathComponent("PlaybackCacheSpec-#{NSUUID.UUID.UUIDString}")
+  end
+
+  after do
+    NSFileManager.defaultManager.removeItemAtPath(@directory, error:nil)
+  end
+
+  it "treats a re-shot file with the same name as a different entry" do
+    cache = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:1024 * 1024)
+    cache.storeData(blobOf(100), forContent:contentAt(1), kind:'thumbnail')
+    reshot = contentAt(1).merge(OLYCameraContentListFilesizeKey => 123)
+    cache.containsContent(contentAt(1), kind:'thumbnail').should == true
+    cache.containsContent(reshot, kind:'thumbnail').should == false
+    cache.containsContent(contentAt(1), kind:'screennail').should == false
+  end
+
+  it "evicts the least recently used entries to stay under the byte budget" do
+    cache = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:3000)
+    (1..3).each { |i| cache.storeData(blobOf(1000), forContent:contentAt(i), kind:'thumbnail') }
+    cache.dataForContent(contentAt(1), kind:'thumbnail').length.should == 1000
+    cache.storeData(blobOf(1000), forContent:contentAt(4), kind:'thumbnail')
+    cache.containsContent(contentAt(1), kind:'thumbnail').should == true
+    cache.containsContent(contentAt(2), kind:'thumbnail').should == false
+    cache.statistics[:totalBytes].should == 3000
+  end
+
+  it "replaces the data when the same content is stored again" do
+    cache = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:1024 * 1024)
+    cache.storeData(blobOf(100), forContent:contentAt(1), kind:'thumbnail').should == true
+    cache.storeData(blobOf(200), forContent:contentAt(1), kind:'thumbnail').should == true
+    cache.dataForContent(contentAt(1), kind:'thumbnail').length.should == 200
+    cache.statistics[:entries].should == 1
+    cache.statistics[:totalBytes].should == 200
+  end
+
+  it "restores the index and the LRU order from disk" do
+    cache = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:3000)
+    (1..3).each { |i| cache.storeData(blobOf(1000), forContent:contentAt(i), kind:'thumbnail') }
+    cache.dataForContent(contentAt(1), kind:'thumbnail')
+    cache.saveIndex
+    reopened = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:3000)
+    reopened.statistics[:entries].should == 3
+    reopened.storeData(blobOf(1000), forContent:contentAt(4), kind:'thumbnail')
+    reopened.containsContent(contentAt(2), kind:'thumbnail').should == false
+    reopened.dataForContent(contentAt(3), kind:'thumbnail').length.should == 1000
+  end
+
+  # tools/camera_stand_in.rb を起動して、.envにCAMERA_STAND_IN_URLを書いておくと実行されます。
+  if App::ENV['CAMERA_STAND_IN_URL']
+    it "shows a 500 item grid faster with a warm cache" do
+      fetcher = PlaybackHttpFetcher.new(App::ENV['CAMERA_STAND_IN_URL'])
+      sema = Dispatch::Semaphore.new(0)
+      contents = nil
+      fetcher.downloadContentList { |list| contents = list; sema.signal }
+      sema.wait
+      contents.size.should >= 500
+      contents = contents.first(500)
+
+      # グリッドを上から下まで、1画面30件ずつスクロールしたとして全件が揃うまでの時間を計ります。
+      showGrid = ->(cache) {
+        prefetcher = PlaybackPrefetcher.new(cache, fetcher)
+        startTime = CACurrentMediaTime()
+        (0...500).step(30) do |first|
+          prefetcher.prefetch(contents, visibleRange:(first...first + 30), kind:'thumbnail')
+          sleep(0.01) while (first...[first + 30, 500].min).any? { |i| !cache.containsContent(contents[i], kind:'thumbnail') }
+        end
+        sleep(0.01) while prefetcher.busy
+        CACurrentMediaTime() - startTime
+      }
+
+      cache = PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:64 * 1024 * 1024)
+      cold = showGrid.call(cache)
+      cache.saveIndex
+      warm = showGrid.call(PlaybackCache.alloc.initWithDirectory(@directory, byteBudget:64 * 1024 * 1024))
+      puts "500 thumbnails: cold=#{(cold * 1000).round}ms, warm=#{(warm * 1000).round}ms"
+      warm.should < cold
+    end
+  end
+
+end
@@ -0,0 +1,227 @@
+# カメラの代わりにOPCの通信仕様書に沿ったHTTP応答を返すスタンドインです。
+# 再生(サムネイルやスクリーンネイル)や取り込み機能のテストとベンチマークで使います。
+#
+#   ruby tools/camera_stand_in.rb --port 8080 --items 500 --latency 0.05
+#   ruby tools/camera_stand_in.rb --raw --bandwidth 2000000 --disconnect-every 3000000
+#
+# 帯域制限と切断の注入は /control?bandwidth=...&disconnect_every=... で実行中にも変更できます。
+# /control?boot=SECONDS を送ると、その秒数が経つまで get_connectmode.cgi に応答しなくなります。(電源投入直後の真似)
+#
+# アプリ側は .env に CAMERA_STAND_IN_URL=http://<このマシンのアドレス>:8080/ を書いておきます。
+require 'socket'
+require 'optparse'
+require 'digest'
+
+class CameraStandIn
+
+  DIRECTORY = '/DCIM/100OLYMP'
+  THUMBNAIL_SIZE = 8 * 1024
+  SCREENNAIL_SIZE = 120 * 1024
+
+  def initialize(options)
+    @port = options[:port]
+    @items = options[:items]
+    @latency = options[:latency]
+    @bandwidth = options[:bandwidth]
+    @disconnectEvery = options[:disconnectEvery]
+    @contents = (1..@items).flat_map do |index|
+      time = Time.local(2015, 10, 1, 12, 0, 0) + index * 2
+      contents = [{ name: format('P%07d.JPG', index), size: 4_000_000 + index * 1024, time: time }]
+      contents << { name: format('P%07d.ORF', index), size: 16_000_000 + index * 1024, time: time } if options[:raw]
+      contents
+    end
+    @requests = Hash.new(0)
+    @sentSinceDisconnect = 0
+    @lock = Mutex.new
+  end
+
+  def run
+    server = TCPServer.new('0.0.0.0', @port)
+    puts "camera stand-in listening on #{@port} (#{@items} items, latency #{@latency}s)"
+    loop do
+      Thread.start(server.accept) do |client|
+        begin
+          handle(client)
+        rescue IOError, SystemCallError
+        ensure
+          client.close unless client.closed?
+        end
+      end
+    end
+  end
+
+  def handle(client)
+    requestLine = client.gets or return
+    method, target, = requestLine.split(' ')
+    headers = {}
+    while (line = client.gets) && line != "\r\n"
+      key, value = line.split(':', 2)
+      headers[key.downcase] = value.strip
+    end
+    path, query = target.split('?', 2)
+    params = Hash[(query || '').split('&').map { |pair| pair.split('=', 2).map { |s| unescape(s) } }]
+    @requests[path] += 1
+    sleep(@latency) if @latency > 0
+
+    case path
+    when '/get_connectmode.cgi'
+      # 起動中のカメラはまだWi-Fiに出てこないので、応答せずに切断します。
+      return client.close if @bootedAt && Time.now < @bootedAt
+      respond(client, 200, 'text/xml', '<?xml version="1.0"?><connectmode>OPC</connectmode>')
+    when '/get_imglist.cgi'
+      respond(client, 200, 'text/plain', imageList(params['DIR']))
+    when '/get_thumbnail.cgi'
+      content = find(params['DIR'])
+      content ? respond(client, 200, 'image/jpeg', blob(content, THUMBNAIL_SIZE)) : respond(client, 404, 'text/plain', '')
+    when '/get_screennail.cgi'
+      content = find(params['DIR'])
+      content ? respond(client, 200, 'image/jpeg', blob(content, SCREENNAIL_SIZE)) : respond(client, 404, 'text/plain', '')
+    when '/sha256'
+      content = find(params['DIR'])
+      content ? respond(client, 200, 'text/plain', sha256(content)) : respond(client, 404, 'text/plain', '')
+    when '/control'
+      @bandwidth = params['bandwidth'].to_i if params['bandwidth']
+      @disconnectEvery = params['disconnect_every'].to_i if params['disconnect_every']
+      @sentSinceDisconnect = 0
+      @bootedAt = Time.now + params['boot'].to_f if params['boot']
+      respond(client, 200, 'text/plain', "bandwidth=#{@bandwidth} disconnect_every=#{@disconnectEvery} booted_at=#{@bootedAt}")
+    when '/stats'
+      respond(client, 200, 'text/plain', @requests.map { |k, v| "#{k} #{v}" }.join("\n"))
+    else
+      content = find(path)
+      content ? sendOriginal(client, content, headers['range']) : respond(client, 404, 'text/plain', '')
+    end
+  end
+
+  # 元画像をRangeヘッダに従って返します。
+  # 帯域を制限し、指定したバイト数を送るごとに接続を切ります。
+  def sendOriginal(client, content, range)
+    first = 0
+    last = content[:size] - 1
+    status = 200
+    if range && range =~ /bytes=(\d+)-(\d*)/
+      first = $1.to_i
+      last = [$2.to_i, last].min unless $2.empty?
+      return respond(client, 416, 'text/plain', '') if first > last
+      status = 206
+    end
+    headers = { 'Accept-Ranges' => 'bytes' }
+    headers['Content-Range'] = "bytes #{first}-#{last}/#{content[:size]}" if status == 206
+    writeHeader(client, status, 'application/octet-stream', last - first + 1, headers)
+    pattern = pattern(content)
+    offset = first
+    startTime = Time.now
+    sent = 0
+    while offset <= last
+      length = [64 * 1024, last - offset + 1].min
+      if @disconnectEvery && @disconnectEvery > 0
+        disconnect = @lock.synchronize {
+          @sentSinceDisconnect += length
+          if @sentSinceDisconnect >= @disconnectEvery
+            @sentSinceDisconnect = 0
+            true
+          end
+        }
+        if disconnect
+          client.write(slice(pattern, offset, length / 2))
+          client.close
+          return
+        end
+      end
+      client.write(slice(pattern, offset, length))
+      offset += length
+      sent += length
+      if @bandwidth && @bandwidth > 0
+        ahead = sent.to_f / @bandwidth - (Time.now - startTime)
+        sleep(ahead) if ahead > 0
+      end
+    end
+  end
+
+  # get_imglist.cgi の応答です。日時はFATのタイムスタンプ形式です。
+  def imageList(directory)
+    lines = ['VER_100']
+    if directory == DIRECTORY
+      @contents.each do |content|
+        t = content[:time]
+        date = ((t.year - 1980) << 9) | (t.month << 5) | t.day
+        time = (t.hour << 11) | (t.min << 5) | (t.sec / 2)
+        lines << [DIRECTORY, content[:name], content[:size], 0, date, time].join(',')
+      end
+    elsif directory == '/DCIM'
+      lines << ['/DCIM', '100OLYMP', 0, 16, 18209, 0].join(',')
+    end
+    lines.join("\r\n") + "\r\n"
+  end
+
+  def find(path)
+    @contents.find { |content| "#{DIRECTORY}/#{content[:name]}" == path }
+  end
+
+  # 元画像の中身は256バイト周期の擬似的なバイト列です。
+  def pattern(content)
+    seed = content[:name].bytes.sum
+    (0...256).map { |i| ((i * 31 + seed) & 0xFF).chr }.join.b
+  end
+
+  def slice(pattern, offset, length)
+    rotated = pattern[offset % 256, 256] + pattern[0, offset % 256]
+    (rotated * (length / 256 + 1))[0, length]
+  end
+
+  def sha256(content)
+    @digests ||= {}
+    @digests[content[:name]] ||= begin
+      digest = Digest::SHA256.new
+      pattern = pattern(content)
+      offset = 0
+      while offset < content[:size]
+        length = [1024 * 1024, content[:size] - offset].min
+        digest << slice(pattern, offset, length)
+        offset += length
+      end
+      digest.hexdigest
+    end
+  end
+
+  # サムネイルなどの中身はファイル名から決まる擬似的なバイト列です。
+  def blob(content, size)
+    @blobs ||= {}
+    @blobs[[content[:name], size]] ||= begin
+      seed = content[:name].bytes.sum
+      ("\xFF\xD8".b + (0...size - 4).map { |i| ((i * 31 + seed) & 0xFF).chr }.join.b + "\xFF\xD9".b)
+    end
+  end
+
+  def respond(client, status, type, body, extraHeaders = {})
+    writeHeader(client, status, type, body.bytesize, extraHeaders)
+    client.write(body)
+  end
+
+  def writeHeader(client, status, type, length, extraHeaders = {})
+    reason = { 200 => 'OK', 206 => 'Partial Content', 404 => 'Not Found', 416 => 'Range Not Satisfiable' }[status]
+    client.write("HTTP/1.1 #{status} #{reason}\r\n")
+    client.write("Content-Type: #{type}\r\n")
+    client.write("Content-Length: #{length}\r\n")
+    extraHeaders.each { |k, v| client.write("#{k}: #{v}\r\n") }
+    client.write("Connection: close\r\n\r\n")
+  end
+
+  def unescape(s)
+    s.gsub('+', ' ').gsub(/%([0-9A-Fa-f]{2})/) { $1.hex.chr }
+  end
+
+end
+
+if $0 == __FILE__
+  options = { port: 8080, items: 500, latency: 0.0, raw: false, bandwidth: nil, disconnectEvery: nil }
+  OptionParser.new do |opts|
+    opts.on('--port PORT', Integer) { |v| options[:port] = v }
+    opts.on('--items N', Integer) { |v| options[:items] = v }
+    opts.on('--latency SECONDS', Float) { |v| options[:latency] = v }
+    opts.on('--raw') { options[:raw] = true }
+    opts.on('--bandwidth BYTES_PER_SECOND', Integer) { |v| options[:bandwidth] = v }
+    opts.on('--disconnect-every BYTES', Integer) { |v| options[:disconnectEvery] = v }
+  end.parse!
+  CameraStandIn.new(options).run
+end